@@ -0,0 +1,134 @@
+/*
+ * Copyright (C) 2021  Christian Berger
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ADAPTIVE_BATCHING_HPP
+#define ADAPTIVE_BATCHING_HPP
+
+#include <algorithm>
+#include <cstdint>
+
+/**
+ * This class tunes the batch size and the flush timeout of the TCP bridge
+ * while the relay is running. It observes the incoming data rate, the rate
+ * at which the clients' sockets take data, and the backlog per client (the
+ * client queue plus the kernel's send queue). From the backlog and the
+ * drain rate, it estimates the write latency a new batch would see:
+ *
+ *  - While the link keeps up (backlog below one batch), the timeout is
+ *    lowered step by step to reduce latency.
+ *  - While the backlog grows (more than two batches), the link is saturated
+ *    and the timeout and thus the batches are enlarged up to the latency
+ *    bound to save system calls per byte.
+ *
+ * Otherwise, the timeout never exceeds the latency bound minus the estimated
+ * write latency. The batch size follows the data that arrives within one
+ * timeout, limited by the maximum batch size.
+ */
+class AdaptiveBatching {
+   private:
+    AdaptiveBatching(const AdaptiveBatching &) = delete;
+    AdaptiveBatching(AdaptiveBatching &&)      = delete;
+    AdaptiveBatching &operator=(const AdaptiveBatching &) = delete;
+    AdaptiveBatching &operator=(AdaptiveBatching &&) = delete;
+
+   public:
+    /**
+     * @param maxBatchSize Upper limit for the batch size.
+     * @param minTimeoutInMicroseconds Lower limit for the flush timeout.
+     * @param maxLatencyInMicroseconds Latency bound for batching plus writing.
+     */
+    AdaptiveBatching(std::size_t maxBatchSize, int64_t minTimeoutInMicroseconds, int64_t maxLatencyInMicroseconds) noexcept
+        : m_maxBatchSize{std::max<std::size_t>(maxBatchSize, 1)}
+        , m_minTimeoutInMicroseconds{std::max<int64_t>(minTimeoutInMicroseconds, 1)}
+        , m_maxLatencyInMicroseconds{std::max(maxLatencyInMicroseconds, m_minTimeoutInMicroseconds)}
+        , m_timeoutInMicroseconds{m_minTimeoutInMicroseconds} {}
+
+    /**
+     * @param bytesIn Total number of bytes added to batches so far.
+     * @param bytesOut Total number of bytes written to all clients so far.
+     * @param numberOfClients Number of connected clients.
+     * @param backlog Largest number of bytes waiting for one client.
+     * @param nowInMicroseconds Current time.
+     */
+    void update(uint64_t bytesIn, uint64_t bytesOut, std::size_t numberOfClients, std::size_t backlog, int64_t nowInMicroseconds) noexcept {
+        const int64_t DT{nowInMicroseconds - m_lastUpdate};
+        if ( (0 == m_lastUpdate) || (0 >= DT) ) {
+            m_lastUpdate = nowInMicroseconds;
+            m_bytesIn = bytesIn;
+            m_bytesOut = bytesOut;
+            return;
+        }
+        const double SECONDS{static_cast<double>(DT) / (1000.0 * 1000.0)};
+        const double RATE_IN{static_cast<double>(bytesIn - m_bytesIn) / SECONDS};
+        const double RATE_OUT{static_cast<double>(bytesOut - m_bytesOut) / SECONDS / static_cast<double>(std::max<std::size_t>(numberOfClients, 1))};
+        m_rateIn += (RATE_IN - m_rateIn) / 4.0;
+        m_rateOut += (RATE_OUT - m_rateOut) / 4.0;
+        m_lastUpdate = nowInMicroseconds;
+        m_bytesIn = bytesIn;
+        m_bytesOut = bytesOut;
+
+        // Time until the backlog is written; while there is a backlog, the
+        // rate at which the socket takes data is the capacity of the link.
+        const double DRAIN_RATE{std::max(std::max(m_rateOut, m_rateIn), 1.0)};
+        m_writeLatencyInMicroseconds = static_cast<int64_t>(static_cast<double>(backlog) / DRAIN_RATE * 1000.0 * 1000.0);
+
+        if (2 * m_batchSize < backlog) {
+            // The link is saturated and cannot meet the latency bound anyway:
+            // larger batches help to reduce the backlog.
+            m_timeoutInMicroseconds = std::min(m_timeoutInMicroseconds * 5 / 4 + 1, m_maxLatencyInMicroseconds);
+        }
+        else {
+            if (backlog <= m_batchSize) {
+                m_timeoutInMicroseconds = m_timeoutInMicroseconds * 7 / 8;
+            }
+            const int64_t BUDGET{m_maxLatencyInMicroseconds - m_writeLatencyInMicroseconds};
+            m_timeoutInMicroseconds = std::max(m_minTimeoutInMicroseconds, std::min(m_timeoutInMicroseconds, BUDGET));
+        }
+
+        const double EXPECTED{m_rateIn * static_cast<double>(m_timeoutInMicroseconds) / (1000.0 * 1000.0)};
+        m_batchSize = std::max<std::size_t>(1, std::min(m_maxBatchSize, static_cast<std::size_t>(EXPECTED)));
+    }
+
+    std::size_t batchSize() const noexcept {
+        return m_batchSize;
+    }
+
+    int64_t timeoutInMicroseconds() const noexcept {
+        return m_timeoutInMicroseconds;
+    }
+
+    int64_t writeLatencyInMicroseconds() const noexcept {
+        return m_writeLatencyInMicroseconds;
+    }
+
+   private:
+    std::size_t m_maxBatchSize;
+    int64_t m_minTimeoutInMicroseconds;
+    int64_t m_maxLatencyInMicroseconds;
+
+    std::size_t m_batchSize{1};
+    int64_t m_timeoutInMicroseconds;
+    int64_t m_writeLatencyInMicroseconds{0};
+
+    int64_t m_lastUpdate{0};
+    uint64_t m_bytesIn{0};
+    uint64_t m_bytesOut{0};
+    double m_rateIn{0.0};
+    double m_rateOut{0.0};
+};
+
+#endif
@@ -0,0 +1,160 @@
+/*
+ * Copyright (C) 2021  Christian Berger
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BANDWIDTH_SHAPER_HPP
+#define BANDWIDTH_SHAPER_HPP
+
+#include "od4-frame.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+/**
+ * This class limits the data rate of a TCP link with a token bucket that is
+ * refilled at the given rate up to the burst size. A batch that exceeds the
+ * available tokens loses its Envelopes of the lowest priority class first:
+ * When conflating, only the most recent Envelope of every stream of that
+ * class is kept at first, and all of them are dropped when this is not
+ * enough, and so on up to priority class 1. Envelopes of priority class 0
+ * are always sent; the tokens they use beyond the available ones are paid
+ * back before lower priority classes are sent again.
+ *
+ * Batches are shaped before they are encoded so that delta frames refer to
+ * Envelopes that were actually sent.
+ */
+class BandwidthShaper {
+   private:
+    BandwidthShaper(const BandwidthShaper &) = delete;
+    BandwidthShaper(BandwidthShaper &&)      = delete;
+    BandwidthShaper &operator=(const BandwidthShaper &) = delete;
+    BandwidthShaper &operator=(BandwidthShaper &&) = delete;
+
+   public:
+    /**
+     * @param bytesPerSecond Rate at which tokens are added.
+     * @param burstSize Maximum number of tokens, i.e., bytes that can be sent at once.
+     * @param isConflating Keep the most recent Envelope per stream before dropping a priority class.
+     * @param priorityClassOf Priority class of a dataType.
+     */
+    BandwidthShaper(double bytesPerSecond, std::size_t burstSize, bool isConflating, std::function<uint32_t(int32_t)> priorityClassOf) noexcept
+        : m_bytesPerSecond{bytesPerSecond}
+        , m_burstSize{static_cast<double>(burstSize)}
+        , m_isConflating{isConflating}
+        , m_priorityClassOf{std::move(priorityClassOf)}
+        , m_tokens{static_cast<double>(burstSize)} {}
+
+    /**
+     * This method removes Envelopes from the given batch as needed to stay within the rate.
+     */
+    void process(std::vector<od4::SharedFrame> &frames, int64_t nowInMicroseconds) noexcept {
+        if (0 < m_lastRefill) {
+            m_tokens = std::min(m_burstSize, m_tokens + m_bytesPerSecond * static_cast<double>(std::max<int64_t>(nowInMicroseconds - m_lastRefill, 0)) / (1000.0 * 1000.0));
+        }
+        m_lastRefill = nowInMicroseconds;
+
+        std::size_t size{sizeOf(frames)};
+        if (m_tokens < static_cast<double>(size)) {
+            // Determine the priority class of every Envelope; extension frames are kept.
+            m_classes.clear();
+            uint32_t lowestPriority{0};
+            for (const auto &f : frames) {
+                od4::EnvelopeInfo info;
+                const uint32_t CLASS{od4::peek(f->data(), f->size(), info) ? m_priorityClassOf(info.dataType) : 0};
+                m_classes.push_back(CLASS);
+                lowestPriority = std::max(lowestPriority, CLASS);
+            }
+            for (uint32_t c{lowestPriority}; (0 < c) && (m_tokens < static_cast<double>(size)); c--) {
+                if (m_isConflating) {
+                    conflate(frames, c);
+                    size = sizeOf(frames);
+                }
+                if (m_tokens < static_cast<double>(size)) {
+                    remove(frames, [c](std::size_t, uint32_t priorityClass) {
+                        return (c == priorityClass);
+                    });
+                    size = sizeOf(frames);
+                }
+            }
+        }
+        // Limit the debt of priority class 0 so that lower priority classes are not starved forever.
+        m_tokens = std::max(m_tokens - static_cast<double>(size), -m_burstSize);
+    }
+
+    uint64_t bytesDropped() const noexcept {
+        return m_bytesDropped;
+    }
+
+   private:
+    static std::size_t sizeOf(const std::vector<od4::SharedFrame> &frames) noexcept {
+        std::size_t size{0};
+        for (const auto &f : frames) {
+            size += f->size();
+        }
+        return size;
+    }
+
+    // Keep only the last Envelope of every stream of the given priority class.
+    void conflate(std::vector<od4::SharedFrame> &frames, uint32_t priorityClass) noexcept {
+        std::unordered_map<uint32_t, std::unordered_map<uint64_t, std::size_t>> last;
+        std::vector<std::pair<uint32_t, uint64_t>> streams(frames.size());
+        uint32_t channel{0};
+        for (std::size_t i{0}; i < frames.size(); i++) {
+            od4::EnvelopeInfo info;
+            if ( !od4::channelOf(frames[i]->data(), frames[i]->size(), channel)
+                 && (priorityClass == m_classes[i]) && od4::peek(frames[i]->data(), frames[i]->size(), info) ) {
+                streams[i] = std::make_pair(channel, (static_cast<uint64_t>(static_cast<uint32_t>(info.dataType)) << 32) | info.senderStamp);
+                last[channel][streams[i].second] = i;
+            }
+        }
+        remove(frames, [priorityClass, &last, &streams](std::size_t i, uint32_t c) {
+            return (priorityClass == c) && (last[streams[i].first][streams[i].second] != i);
+        });
+    }
+
+    template <typename Predicate>
+    void remove(std::vector<od4::SharedFrame> &frames, Predicate &&isToBeRemoved) noexcept {
+        std::size_t kept{0};
+        for (std::size_t i{0}; i < frames.size(); i++) {
+            if (isToBeRemoved(i, m_classes[i])) {
+                m_bytesDropped += frames[i]->size();
+                continue;
+            }
+            frames[kept] = std::move(frames[i]);
+            m_classes[kept] = m_classes[i];
+            kept++;
+        }
+        frames.resize(kept);
+        m_classes.resize(kept);
+    }
+
+   private:
+    double m_bytesPerSecond;
+    double m_burstSize;
+    bool m_isConflating;
+    std::function<uint32_t(int32_t)> m_priorityClassOf;
+
+    double m_tokens;
+    int64_t m_lastRefill{0};
+    uint64_t m_bytesDropped{0};
+    std::vector<uint32_t> m_classes{};
+};
+
+#endif
@@ -0,0 +1,272 @@
+/*
+ * Copyright (C) 2021  Christian Berger
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BATCH_ASSEMBLER_HPP
+#define BATCH_ASSEMBLER_HPP
+
+#include "od4-frame.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+/**
+ * This class collects serialized Envelopes into batches of up to mtu bytes
+ * using double buffering: Callers append to the filling batch, while a
+ * separate thread hands the completed batches to the delegate. Completing a
+ * batch only exchanges the filling batch with a spare one, so appending
+ * never waits for the delegate; the spare batch is prepared by the sending
+ * thread. If the delegate falls behind, further batches are allocated up to
+ * an optional backlog, beyond which the oldest completed batches are dropped.
+ * A batch refers to its serialized Envelopes instead of copying them.
+ *
+ * A batch is completed when it exceeds mtu bytes or when the given timeout
+ * has passed since its first Envelope was added, whichever comes first.
+ *
+ * When Envelopes of several channels share the batches, every batch starts
+ * with a channel frame and every change of the channel within a batch is
+ * marked by another one, so that every batch can be demultiplexed on its own.
+ */
+class BatchAssembler {
+   private:
+    BatchAssembler(const BatchAssembler &) = delete;
+    BatchAssembler(BatchAssembler &&)      = delete;
+    BatchAssembler &operator=(const BatchAssembler &) = delete;
+    BatchAssembler &operator=(BatchAssembler &&) = delete;
+
+   public:
+    using Delegate = std::function<void(std::vector<od4::SharedFrame> &&)>;
+
+   private:
+    struct Batch {
+        std::vector<od4::SharedFrame> frames{};
+        std::size_t size{0};
+        bool hasChannel{false};
+        uint32_t channel{0};
+    };
+
+   public:
+    /**
+     * @param mtu Complete a batch when it exceeds this many bytes.
+     * @param timeoutInMicroseconds Complete a batch at the latest after this time (0: only on flush).
+     * @param delegate Called from a separate thread for every completed batch.
+     * @param maxBacklog Bytes of completed batches that may wait for the delegate (0: unbounded).
+     */
+    BatchAssembler(std::size_t mtu, int64_t timeoutInMicroseconds, Delegate delegate, std::size_t maxBacklog = 0) noexcept
+        : m_mtu{mtu}
+        , m_timeout{std::chrono::microseconds(timeoutInMicroseconds)}
+        , m_delegate(std::move(delegate))
+        , m_maxBacklog{maxBacklog} {
+        m_senderThreadRunning.store(true);
+        m_senderThread = std::thread(&BatchAssembler::sendBatches, this);
+    }
+
+    /**
+     * The destructor sends the pending batches before it returns.
+     */
+    ~BatchAssembler() {
+        flush();
+        {
+            std::lock_guard<std::mutex> lck(m_mutex);
+            m_senderThreadRunning.store(false);
+        }
+        m_condition.notify_all();
+        try {
+            if (m_senderThread.joinable()) {
+                m_senderThread.join();
+            }
+        } catch (...) {}
+    }
+
+   public:
+    /**
+     * @param frame Serialized Envelope to append to the current batch.
+     * @param flushNow Complete the batch right after appending.
+     */
+    void add(std::string &&frame, bool flushNow) noexcept {
+        append(std::move(frame), flushNow, nullptr);
+    }
+
+    /**
+     * @param frame Serialized Envelope to append to the current batch.
+     * @param flushNow Complete the batch right after appending.
+     * @param channel Channel the Envelope belongs to.
+     */
+    void add(std::string &&frame, bool flushNow, uint32_t channel) noexcept {
+        append(std::move(frame), flushNow, &channel);
+    }
+
+    /**
+     * This method changes the limits for the batches that are started afterwards.
+     */
+    void setLimits(std::size_t mtu, int64_t timeoutInMicroseconds) noexcept {
+        std::lock_guard<std::mutex> lck(m_mutex);
+        m_mtu = mtu;
+        m_timeout = std::chrono::microseconds(timeoutInMicroseconds);
+    }
+
+    /**
+     * @return Total number of bytes added so far.
+     */
+    uint64_t bytesAdded() const noexcept {
+        return m_bytesAdded.load();
+    }
+
+    /**
+     * @return Total number of bytes dropped because the delegate fell behind by more than maxBacklog.
+     */
+    uint64_t bytesDropped() const noexcept {
+        return m_bytesDropped.load();
+    }
+
+    /**
+     * This method completes the current batch if it is not empty.
+     */
+    void flush() noexcept {
+        {
+            std::lock_guard<std::mutex> lck(m_mutex);
+            if (0 < m_filling->size) {
+                complete();
+            }
+        }
+        m_condition.notify_one();
+    }
+
+   private:
+    void append(std::string &&frame, bool flushNow, const uint32_t *channel) noexcept {
+        // Allocate the shared frame outside of the lock.
+        od4::SharedFrame shared{std::make_shared<const std::string>(std::move(frame))};
+        m_bytesAdded += shared->size();
+        {
+            std::lock_guard<std::mutex> lck(m_mutex);
+            // Do we have to complete the batch first?
+            if ( (0 < m_filling->size) && (m_mtu < (m_filling->size + shared->size())) ) {
+                complete();
+            }
+            if ( (0 == m_filling->size) && (0 < m_timeout.count()) ) {
+                // The first Envelope of a batch arms its deadline.
+                m_deadline = std::chrono::steady_clock::now() + m_timeout;
+                m_hasDeadline = true;
+            }
+            if ( (nullptr != channel) && (!m_filling->hasChannel || (*channel != m_filling->channel)) ) {
+                m_filling->hasChannel = true;
+                m_filling->channel = *channel;
+                m_filling->frames.emplace_back(std::make_shared<const std::string>(od4::channelFrame(*channel)));
+                m_filling->size += m_filling->frames.back()->size();
+            }
+            m_filling->size += shared->size();
+            m_filling->frames.emplace_back(std::move(shared));
+            // Do we have to complete the batch again?
+            if ( (m_mtu < m_filling->size) || flushNow ) {
+                complete();
+            }
+        }
+        m_condition.notify_one();
+    }
+
+    // Must be called with m_mutex locked.
+    void complete() noexcept {
+        m_hasDeadline = false;
+        m_backlog += m_filling->size;
+        m_completed.emplace_back(std::move(m_filling));
+        // The batch that was just completed is kept even if it exceeds the backlog on its own.
+        while ( (0 < m_maxBacklog) && (m_maxBacklog < m_backlog) && (1 < m_completed.size()) ) {
+            m_backlog -= m_completed.front()->size;
+            m_bytesDropped += m_completed.front()->size;
+            m_completed.pop_front();
+        }
+        if (m_spare) {
+            m_filling = std::move(m_spare);
+        }
+        else {
+            m_filling.reset(new Batch());
+        }
+    }
+
+    void sendBatches() noexcept {
+        while (true) {
+            std::unique_ptr<Batch> batch;
+            {
+                std::unique_lock<std::mutex> lck(m_mutex);
+                while (m_completed.empty() && m_senderThreadRunning.load()) {
+                    if (!m_hasDeadline) {
+                        m_condition.wait(lck);
+                    }
+                    else if (m_deadline <= std::chrono::steady_clock::now()) {
+                        complete();
+                    }
+                    else {
+                        m_condition.wait_until(lck, m_deadline);
+                    }
+                }
+                if (m_completed.empty()) {
+                    break;
+                }
+                batch = std::move(m_completed.front());
+                m_completed.pop_front();
+                m_backlog -= batch->size;
+            }
+            const std::size_t CAPACITY{batch->frames.size()};
+            if (nullptr != m_delegate) {
+                m_delegate(std::move(batch->frames));
+            }
+            // Prepare the batch to be the next spare one.
+            batch->frames.clear();
+            batch->frames.reserve(CAPACITY);
+            batch->size = 0;
+            batch->hasChannel = false;
+            {
+                std::lock_guard<std::mutex> lck(m_mutex);
+                if (!m_spare) {
+                    m_spare = std::move(batch);
+                }
+            }
+        }
+    }
+
+   private:
+    std::size_t m_mtu;
+    std::chrono::microseconds m_timeout;
+    Delegate m_delegate;
+    std::size_t m_maxBacklog;
+
+    std::mutex m_mutex{};
+    std::condition_variable m_condition{};
+    std::unique_ptr<Batch> m_filling{new Batch()};
+    std::unique_ptr<Batch> m_spare{new Batch()};
+    std::deque<std::unique_ptr<Batch>> m_completed{};
+    std::size_t m_backlog{0};
+    bool m_hasDeadline{false};
+    std::chrono::steady_clock::time_point m_deadline{};
+
+    std::atomic<uint64_t> m_bytesAdded{0};
+    std::atomic<uint64_t> m_bytesDropped{0};
+
+    std::atomic<bool> m_senderThreadRunning{false};
+    std::thread m_senderThread{};
+};
+
+#endif
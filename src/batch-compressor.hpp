@@ -0,0 +1,133 @@
+/*
+ * Copyright (C) 2021  Christian Berger
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BATCH_COMPRESSOR_HPP
+#define BATCH_COMPRESSOR_HPP
+
+#include "lz4-block.hpp"
+#include "od4-frame.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+/**
+ * This class replaces a batch of frames by one compressed extension frame
+ * when compression pays off: It measures the compression ratio and the time
+ * spent per byte and compresses only while the time saved on a link with the
+ * given rate exceeds the time spent on compressing and decompressing. While
+ * compression is off, every PROBE_INTERVAL-th batch is compressed anyway to
+ * notice when the data becomes compressible again.
+ */
+class BatchCompressor {
+   private:
+    BatchCompressor(const BatchCompressor &) = delete;
+    BatchCompressor(BatchCompressor &&)      = delete;
+    BatchCompressor &operator=(const BatchCompressor &) = delete;
+    BatchCompressor &operator=(BatchCompressor &&) = delete;
+
+   public:
+    /**
+     * @param linkBytesPerSecond Expected rate of the link to the clients.
+     */
+    explicit BatchCompressor(double linkBytesPerSecond) noexcept
+        : m_linkMicrosecondsPerByte{1000.0 * 1000.0 / std::max(linkBytesPerSecond, 1.0)} {}
+
+    /**
+     * This method replaces the given frames by a compressed frame if worthwhile.
+     */
+    void process(std::vector<od4::SharedFrame> &frames) noexcept {
+        std::size_t size{0};
+        for (const auto &f : frames) {
+            size += f->size();
+        }
+        if ( (size < MIN_SIZE) || (!m_isEnabled && (++m_batchesSinceProbe < PROBE_INTERVAL)) ) {
+            return;
+        }
+        m_batchesSinceProbe = 0;
+
+        const auto START{std::chrono::steady_clock::now()};
+        m_buffer.clear();
+        m_buffer.reserve(size);
+        for (const auto &f : frames) {
+            m_buffer.append(*f);
+        }
+        std::string compressed{od4::beginExtension(od4::ExtensionType::COMPRESSED_BATCH)};
+        od4::writeVarInt(compressed, size);
+        lz4::compress(m_buffer.data(), m_buffer.size(), compressed);
+        const double MICROSECONDS{static_cast<double>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - START).count()) / 1000.0};
+
+        // Decompressing is considerably faster than compressing.
+        const double RATIO{static_cast<double>(compressed.size()) / static_cast<double>(size)};
+        const double COST{MICROSECONDS * 1.25 / static_cast<double>(size)};
+        m_ratio = (0.0 < m_ratio) ? (0.75 * m_ratio + 0.25 * RATIO) : RATIO;
+        m_microsecondsPerByte = (0.0 < m_microsecondsPerByte) ? (0.75 * m_microsecondsPerByte + 0.25 * COST) : COST;
+        m_isEnabled = ( (m_ratio < MAX_RATIO) && (m_microsecondsPerByte < (1.0 - m_ratio) * m_linkMicrosecondsPerByte) );
+
+        if ( (compressed.size() < size) && od4::finishExtension(compressed) ) {
+            frames.clear();
+            frames.emplace_back(std::make_shared<const std::string>(std::move(compressed)));
+        }
+    }
+
+    /**
+     * This method restores the frames of a compressed extension frame.
+     *
+     * @param out Receives the concatenated frames.
+     * @return false if the given frame is malformed.
+     */
+    static bool decompress(const char *frame, std::size_t length, std::string &out) noexcept {
+        std::size_t pos{od4::EXTENSION_HEADER_SIZE};
+        uint64_t size{0};
+        if ( !od4::isExtension(frame, length)
+             || (od4::ExtensionType::COMPRESSED_BATCH != od4::extensionType(frame))
+             || !od4::readVarInt(frame, length, pos, size)
+             || (MAX_DECOMPRESSED_SIZE < size) ) {
+            return false;
+        }
+        out.resize(static_cast<std::size_t>(size));
+        return lz4::decompress(frame + pos, length - pos, &out[0], out.size());
+    }
+
+    bool isEnabled() const noexcept {
+        return m_isEnabled;
+    }
+
+    double ratio() const noexcept {
+        return m_ratio;
+    }
+
+   private:
+    static constexpr std::size_t MIN_SIZE{256};
+    static constexpr uint32_t PROBE_INTERVAL{32};
+    static constexpr double MAX_RATIO{0.9};
+    // A batch holds up to 16MiB plus the frame that completed it.
+    static constexpr uint64_t MAX_DECOMPRESSED_SIZE{32 * 1024 * 1024};
+
+    double m_linkMicrosecondsPerByte;
+    bool m_isEnabled{true};
+    uint32_t m_batchesSinceProbe{0};
+    double m_ratio{0.0};
+    double m_microsecondsPerByte{0.0};
+    std::string m_buffer{};
+};
+
+#endif
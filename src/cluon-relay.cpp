@@ -16,51 +16,141 @@
  */
 
 #include "cluon-complete.hpp"
+#include "adaptive-batching.hpp"
+#include "bandwidth-shaper.hpp"
+#include "batch-assembler.hpp"
+#include "batch-compressor.hpp"
+#include "compact-batch.hpp"
+#include "envelope-deduplicator.hpp"
+#include "envelope-restorer.hpp"
+#include "multicast-sender.hpp"
+#include "od4-frame.hpp"
+#include "overload-controller.hpp"
+#include "priority-dispatcher.hpp"
+#include "resumable-session.hpp"
+#include "snapshot-cache.hpp"
+#include "stream-delta.hpp"
+#include "subscription.hpp"
+#include "synchronized-downsampler.hpp"
+#include "tcp-fanout.hpp"
 
 #include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
 #include <iostream>
+#include <mutex>
+#include <random>
 #include <thread>
 
+// Raw bytes of an Envelope received from --cid-from that is waiting to be relayed.
+struct ReceivedEnvelope {
+    std::string data{};
+    std::chrono::system_clock::time_point timepoint{};
+    od4::EnvelopeInfo info{};
+    uint32_t priorityClass{0};
+    std::size_t worker{0};
+    uint32_t channel{0};
+};
+
 int32_t main(int32_t argc, char **argv) {
     int32_t retCode{0};
 
     auto usage = [&argv, &retCode](){
         std::cerr << argv[0] << " relays Envelopes from one CID to another CID." << std::endl;
-        std::cerr << "Usage:   " << argv[0] << " --cid-from=<source CID> [--via-tcp=<port|ip:port> [--mtu=<MTU>] [--timeout=<Timeout>]] --cid-to=<destination> [--keep=<list of messageIDs to keep>] [--drop=<list of messageIDs to drop>] [--downsampling=<list of messageIDs to downsample>]" << std::endl;
+        std::cerr << "Usage:   " << argv[0] << " --cid-from=<source CID> [--via-tcp=<port|ip:port> [--mtu=<MTU>] [--timeout=<Timeout>|--timeout-us=<Timeout>] [--adaptive=<latency bound in us>] [--compress=<link rate in Mbit/s>] [--delta=<keyframe interval>] [--compact] [--subscribe=<list of messageIDs to receive>] [--snapshot=<list of messageIDs to cache for new clients>] [--replay=<KiB>] [--max-bandwidth=<kbit/s>[:<burst KiB>]] [--client-queue=<KiB>] [--overflow=<drop|conflate|disconnect>]] --cid-to=<destination> [--keep=<list of messageIDs to keep>] [--drop=<list of messageIDs to drop>] [--downsampling=<list of messageIDs to downsample>] [--dedup=<time window in ms>[:<max entries>]] [--max-hops=<number of relays>] [--shed=<list of messageIDs to shed under overload> [--shed-lag=<ms>] [--shed-backlog=<Envelopes>]] [--priority=<list of messageIDs and priority classes> [--priority-weights=<list of weights>]] [--mirror=<CID>:<N>[:random]] [--downsample-sync=<list of ID groups to downsample together>] [--workers=<N>]" << std::endl;
         std::cerr << "         --cid-from:      relay Envelopes originating from this CID" << std::endl;
         std::cerr << "         --cid-to:        relay Envelopes to this CID (must be different from source)" << std::endl;
+        std::cerr << "                          with --via-tcp, both may be lists to relay several CIDs over one connection: the Envelopes from the n-th CID" << std::endl;
+        std::cerr << "                          of --cid-from on one side are relayed to the n-th CID of --cid-to on the other side; example: --cid-from=111,115" << std::endl;
         std::cerr << "         --via-tcp:       relay Envelopes via a TCP connection; one needs two instances of " << argv[0] << ", where" << std::endl;
         std::cerr << "                          the server (--cid-from) is using --via-tcp=Port (eg., --via-tcp=1234, port > 1023)," << std::endl;
-        std::cerr << "                          and the client (--cid-to) is using --via-tcp=IP:Port (eg., --via-tcp=a.b.c.d:1234)." << std::endl;
-        std::cerr << "         --mtu:           fill a TCP packet up to this amount instead of sending one for each Envelope; default: 1 (to send for every Envelope)" << std::endl;
+        std::cerr << "                          and the client (--cid-to) is using --via-tcp=IP:Port (eg., --via-tcp=a.b.c.d:1234); with both --cid-from and" << std::endl;
+        std::cerr << "                          --cid-to on both sides, Envelopes are relayed in both directions over the same connection." << std::endl;
+        std::cerr << "         --mtu:           fill a TCP packet up to this amount instead of sending one for each Envelope (up to 16MiB); default: 1 (to send for every Envelope)" << std::endl;
         std::cerr << "         --timeout:       send TCP packet after this timeout in ms even if it is not fully filled; default: 1000ms" << std::endl;
+        std::cerr << "         --timeout-us:    like --timeout but in microseconds; supersedes --timeout" << std::endl;
+        std::cerr << "         --adaptive:      tune batch size and timeout continuously from the data rate and the clients' send queues while keeping" << std::endl;
+        std::cerr << "                          the latency below this bound in us; --mtu limits the batch size (default: 1MiB); supersedes --timeout" << std::endl;
+        std::cerr << "         --compress:      compress TCP batches whenever this saves time on a link of this rate in Mbit/s; example: --compress=100" << std::endl;
+        std::cerr << "         --delta:         send Envelopes via TCP as differences to the previous Envelope of the same ID and senderStamp" << std::endl;
+        std::cerr << "                          with a complete one after this many Envelopes; example: --delta=100" << std::endl;
+        std::cerr << "         --compact:       send the Envelopes of a TCP batch with one header, shared IDs and senderStamps, and time stamps relative to the batch" << std::endl;
+        std::cerr << "         --subscribe:     TCP client only: receive only these Envelope IDs, optionally of one senderStamp and at most at a rate in Hz;" << std::endl;
+        std::cerr << "                          the server filters the Envelopes for this client before sending them; example: --subscribe=19,31/2,12@10" << std::endl;
+        std::cerr << "         --snapshot:      TCP server only: keep the last Envelope of every senderStamp of these Envelope IDs and send them to new clients" << std::endl;
+        std::cerr << "                          before the live Envelopes; ID:N keeps at most N senderStamps of ID (default: 16); example: --snapshot=12,31:4" << std::endl;
+        std::cerr << "         --replay:        TCP server only: number the batches and keep the last KiB of them so that clients, which acknowledge" << std::endl;
+        std::cerr << "                          what they received and reconnect automatically, resume without losing Envelopes; example: --replay=16384" << std::endl;
+        std::cerr << "         --max-bandwidth: limit every TCP stream to this rate in kbit/s with bursts of up to the given KiB (default: 100ms of the rate);" << std::endl;
+        std::cerr << "                          beyond that, Envelopes of the lowest priority classes (--priority) are conflated (--overflow=conflate)" << std::endl;
+        std::cerr << "                          or dropped, those of priority class 0 are always sent; example: --max-bandwidth=2000:64" << std::endl;
+        std::cerr << "         --client-queue:  maximum amount of data in KiB waiting to be sent to one TCP client, or to the server from a client with --cid-from; default: 4096KiB" << std::endl;
+        std::cerr << "         --overflow:      what to do when a TCP client's queue is full: drop the new data for this client, conflate the queued data" << std::endl;
+        std::cerr << "                          that was not started yet with the new data, or disconnect the client; default: drop, or disconnect with --replay" << std::endl;
         std::cerr << "         --keep:          list of Envelope IDs to keep; example: --keep=19,25" << std::endl;
         std::cerr << "         --drop:          list of Envelope IDs to drop; example: --drop=17,35" << std::endl;
         std::cerr << "         --downsampling:  list of Envelope IDs to downsample; example: --downsample=12:2,31:10  keep every second of 12 and every tenth of 31" << std::endl;
+        std::cerr << "         --dedup:         suppress identical Envelopes (same ID, senderStamp, sampleTimeStamp, and payload) arriving again within this time window in ms;" << std::endl;
+        std::cerr << "                          at most the given number of Envelopes is remembered (default: 65536); example: --dedup=500:200000" << std::endl;
+        std::cerr << "         --max-hops:      mark relayed Envelopes with the number of relays they passed and do not relay Envelopes that passed this many relays already;" << std::endl;
+        std::cerr << "                          use --max-hops=1 to safely run relays in opposite directions between two CIDs" << std::endl;
+        std::cerr << "         --shed:          when the relay falls behind, shed load following this priority list (lowest priority first); an entry ID:N additionally" << std::endl;
+        std::cerr << "                          keeps only every N-th Envelope of ID, an entry ID drops ID entirely; example: --shed=31:10,17,31" << std::endl;
+        std::cerr << "         --shed-lag:      activate the next --shed entry when Envelopes wait longer than this many ms to be processed; default: 100ms" << std::endl;
+        std::cerr << "         --shed-backlog:  activate the next --shed entry when more than this many Envelopes are waiting to be processed; default: 1000" << std::endl;
+        std::cerr << "         --priority:      relay Envelopes by priority class (0 is highest) using one queue per class; * sets the class for not listed IDs (default: lowest);" << std::endl;
+        std::cerr << "                          example: --priority=19:0,*:1,31:2" << std::endl;
+        std::cerr << "         --priority-weights: serve the priority classes weighted instead of strictly, i.e., up to this many Envelopes per class in turn; example: --priority-weights=8,4,1" << std::endl;
+        std::cerr << "         --mirror:        copy every N-th Envelope (or, with :random, each one with probability 1/N) received from --cid-from before any filtering to this CID;" << std::endl;
+        std::cerr << "                          example: --mirror=200:100" << std::endl;
+        std::cerr << "         --downsample-sync: list of ID groups to downsample together; example: --downsample-sync=12+31:10:20  keep every tenth of 12 and for each" << std::endl;
+        std::cerr << "                          kept 12 the first 31 whose sampleTimeStamp is within 20ms of it" << std::endl;
+        std::cerr << "         --workers:       decode, filter, and encode Envelopes in N threads; Envelopes with the same ID and senderStamp keep their order; default: 1" << std::endl;
         std::cerr << "                          --keep and --drop must not be used simultaneously." << std::endl;
         std::cerr << "                          Neither specifying --keep, --drop, or --downsample will simply pass all Envelopes from --cid-from to --cid-to." << std::endl;
         std::cerr << "                          Not matching Envelope IDs with --keep are dropped." << std::endl;
         std::cerr << "                          Not matching Envelope IDs with --drop are kept." << std::endl;
         std::cerr << "                          An Envelope IDs with downsampling information supersedes --keep." << std::endl;
+        std::cerr << "                          An Envelope ID in a --downsample-sync group supersedes --downsample, --keep, and --drop." << std::endl;
         std::cerr << "Examples: " << std::endl;
         std::cerr << "UDP:          " << argv[0] << " --cid-from=111 --cid-to=112 --keep=123" << std::endl;
         std::cerr << "TCP (server): " << argv[0] << " --cid-from=111 --via-tcp=1234 --keep=123" << std::endl;
         std::cerr << "TCP (client): " << argv[0] << " --cid-to=112 --via-tcp=192.168.2.3:1234" << std::endl;
+        std::cerr << "TCP (both directions): " << argv[0] << " --cid-from=111 --cid-to=113 --via-tcp=1234 --max-hops=1 and " << argv[0] << " --cid-from=114 --cid-to=112 --via-tcp=192.168.2.3:1234 --max-hops=1" << std::endl;
+        std::cerr << "TCP (several CIDs): " << argv[0] << " --cid-from=111,115 --via-tcp=1234 and " << argv[0] << " --cid-to=112,116 --via-tcp=192.168.2.3:1234" << std::endl;
         retCode = 1;
     };
 
     auto commandlineArguments = cluon::getCommandlineArguments(argc, argv);
+    // With --via-tcp, --cid-from and --cid-to may list several CIDs; the n-th CID of
+    // --cid-from on one side is relayed to the n-th CID of --cid-to on the other side.
+    auto listOfCIDs = [&commandlineArguments](const std::string &key){
+        std::vector<std::string> cids;
+        if (0 < commandlineArguments.count(key)) {
+            for (auto e : stringtoolbox::split(commandlineArguments[key] + ",", ',')) {
+                if (!e.empty()) {
+                    cids.push_back(e);
+                }
+            }
+        }
+        return cids;
+    };
+    const std::vector<std::string> CIDS_FROM{listOfCIDs("cid-from")};
+    const std::vector<std::string> CIDS_TO{listOfCIDs("cid-to")};
+    bool hasCommonCID{false};
+    for (const auto &cid : CIDS_FROM) {
+        hasCommonCID |= (CIDS_TO.end() != std::find(CIDS_TO.begin(), CIDS_TO.end(), cid));
+    }
     if ( ( (    (0 == commandlineArguments.count("cid-from"))
              || (0 == commandlineArguments.count("cid-to")) )
            && (0 == commandlineArguments.count("via-tcp"))
          )
-       || ( (1 == commandlineArguments.count("via-tcp")) &&
-            (   (1 == commandlineArguments.count("cid-from"))
-             && (1 == commandlineArguments.count("cid-to")) )
-          )
-       || ( (1 == commandlineArguments.count("cid-from")) && (1 == commandlineArguments.count("cid-to")) 
-          && (commandlineArguments["cid-from"] == commandlineArguments["cid-to"]) )
+       || hasCommonCID
+       || ( (0 == commandlineArguments.count("via-tcp")) && ( (1 < CIDS_FROM.size()) || (1 < CIDS_TO.size()) ) )
        || ( (1 == commandlineArguments.count("keep")) && (1 == commandlineArguments.count("drop")) )
+       || ( (1 == commandlineArguments.count("overflow"))
+          && ("drop" != commandlineArguments["overflow"]) && ("conflate" != commandlineArguments["overflow"]) && ("disconnect" != commandlineArguments["overflow"]) )
        ) {
         usage();
     } else {
@@ -71,8 +161,10 @@ int32_t main(int32_t argc, char **argv) {
                 tmp += ",";
                 auto entries = stringtoolbox::split(tmp, ',');
                 for (auto e : entries) {
-                    std::clog << argv[0] << " keeping " << e << std::endl;
-                    mapOfEnvelopesToKeep[std::stoi(e)] = true;
+                    if (!e.empty()) {
+                        std::clog << argv[0] << " keeping " << e << std::endl;
+                        mapOfEnvelopesToKeep[std::stoi(e)] = true;
+                    }
                 }
             }
         }
@@ -83,14 +175,17 @@ int32_t main(int32_t argc, char **argv) {
                 tmp += ",";
                 auto entries = stringtoolbox::split(tmp, ',');
                 for (auto e : entries) {
-                    std::clog << argv[0] << " dropping " << e << std::endl;
-                    mapOfEnvelopesToDrop[std::stoi(e)] = true;
+                    if (!e.empty()) {
+                        std::clog << argv[0] << " dropping " << e << std::endl;
+                        mapOfEnvelopesToDrop[std::stoi(e)] = true;
+                    }
                 }
             }
         }
 
         std::unordered_map<int32_t, uint32_t, cluon::UseUInt32ValueAsHashKey> downsampling{};
-        std::unordered_map<int32_t, uint32_t, cluon::UseUInt32ValueAsHashKey> downsamplingCounter{};
+        // Every source CID has its own counters, keyed by channel and ID.
+        std::unordered_map<uint64_t, uint32_t> downsamplingCounter{};
         {
             std::string tmp{commandlineArguments["downsample"]};
             if (!tmp.empty()) {
@@ -101,18 +196,426 @@ int32_t main(int32_t argc, char **argv) {
                     if ( (2 == l.size()) && (std::stoi(l[1]) > 0) ) {
                         std::clog << argv[0] << " using every " << l[1] << "-th Envelope with id " << l[0] << std::endl;
                         downsampling[std::stoi(l[0])] = std::stoi(l[1]);
-                        downsamplingCounter[std::stoi(l[0])] = std::stoi(l[1]);
                     }
                 }
             }
         }
 
+        SynchronizedDownsampler synchronizedDownsampler;
+        {
+            std::string tmp{commandlineArguments["downsample-sync"]};
+            if (!tmp.empty()) {
+                tmp += ",";
+                auto entries = stringtoolbox::split(tmp, ',');
+                for (auto e : entries) {
+                    auto l = stringtoolbox::split(e, ':');
+                    if ( (3 == l.size()) && (std::stoi(l[1]) > 0) && (std::stoi(l[2]) >= 0) ) {
+                        std::vector<int32_t> group;
+                        auto ids = stringtoolbox::split(l[0], '+');
+                        for (auto id : (ids.empty() ? std::vector<std::string>{l[0]} : ids)) {
+                            group.push_back(std::stoi(id));
+                        }
+                        std::clog << argv[0] << " using every " << l[1] << "-th Envelope with id " << group[0] << " together with the Envelopes with ids " << l[0] << " within " << l[2] << "ms" << std::endl;
+                        synchronizedDownsampler.addGroup(std::move(group), static_cast<uint32_t>(std::stoi(l[1])), static_cast<int64_t>(std::stoi(l[2])) * 1000);
+                    }
+                }
+            }
+        }
+
+        const uint32_t WORKERS{(0 < commandlineArguments.count("workers")) ? static_cast<uint32_t>(std::max(1, std::stoi(commandlineArguments["workers"]))) : 1};
+        if (1 < WORKERS) {
+            std::clog << argv[0] << " relaying Envelopes with " << WORKERS << " workers" << std::endl;
+        }
+
+        // As Envelopes with the same ID and senderStamp are always handled by the same worker, each worker has its own deduplicator.
+        std::vector<std::unique_ptr<EnvelopeDeduplicator>> deduplicators;
+        if (0 < commandlineArguments.count("dedup")) {
+            // The number of fingerprints must cover the Envelopes arriving within the window: <ms>[:<max entries>].
+            const std::string tmp{commandlineArguments["dedup"]};
+            const std::size_t COLON{tmp.find(':')};
+            const int64_t WINDOW{std::stoi(tmp.substr(0, COLON))};
+            const std::size_t MAX_ENTRIES{(std::string::npos == COLON) ? 65536 : static_cast<std::size_t>(std::max(1, std::stoi(tmp.substr(COLON + 1))))};
+            std::clog << argv[0] << " suppressing duplicate Envelopes within " << WINDOW << "ms remembering up to " << MAX_ENTRIES << " Envelopes" << std::endl;
+            for (uint32_t i{0}; i < WORKERS; i++) {
+                deduplicators.emplace_back(std::make_unique<EnvelopeDeduplicator>(WINDOW * 1000, MAX_ENTRIES));
+            }
+        }
+
+        const uint32_t MAX_HOPS{(0 < commandlineArguments.count("max-hops")) ? static_cast<uint32_t>(std::stoi(commandlineArguments["max-hops"])) : 0};
+        if (0 < MAX_HOPS) {
+            std::clog << argv[0] << " marking relayed Envelopes and dropping Envelopes that passed " << MAX_HOPS << " relay(s) already" << std::endl;
+        }
+
+        std::unique_ptr<OverloadController> overloadController{nullptr};
+        {
+            std::string tmp{commandlineArguments["shed"]};
+            if (!tmp.empty()) {
+                std::vector<OverloadController::Stage> stages;
+                tmp += ",";
+                auto entries = stringtoolbox::split(tmp, ',');
+                for (auto e : entries) {
+                    if (!e.empty()) {
+                        auto l = stringtoolbox::split(e, ':');
+                        OverloadController::Stage stage;
+                        stage.dataType = std::stoi(l.empty() ? e : l[0]);
+                        stage.downsampling = ( (2 == l.size()) && (std::stoi(l[1]) > 0) ) ? static_cast<uint32_t>(std::stoi(l[1])) : 0;
+                        std::clog << argv[0] << " under overload, " << ((0 < stage.downsampling) ? "using only every " + std::to_string(stage.downsampling) + "-th Envelope" : "dropping Envelopes") << " with id " << stage.dataType << std::endl;
+                        stages.push_back(stage);
+                    }
+                }
+                const int64_t MAX_LAG{(0 < commandlineArguments.count("shed-lag")) ? std::stoi(commandlineArguments["shed-lag"]) : 100};
+                const std::size_t MAX_BACKLOG{(0 < commandlineArguments.count("shed-backlog")) ? static_cast<std::size_t>(std::stoi(commandlineArguments["shed-backlog"])) : 1000};
+                overloadController = std::make_unique<OverloadController>(std::move(stages), MAX_LAG * 1000, MAX_BACKLOG);
+            }
+        }
+
+        // Decide whether an Envelope is to be relayed according to --keep, --drop, and --downsample.
+        std::mutex downsamplingMutex;
+        auto isToBeRelayed = [&mapOfEnvelopesToKeep, &mapOfEnvelopesToDrop, &downsampling, &downsamplingCounter, &downsamplingMutex](const cluon::data::Envelope &env, uint32_t channel){
+            bool retVal{false};
+            auto id{env.dataType()};
+            if ( downsampling.empty() && mapOfEnvelopesToKeep.empty() && mapOfEnvelopesToDrop.empty() ) {
+                retVal = true;
+            }
+            else if ( (0 < downsampling.size()) && downsampling.count(env.dataType()) ) {
+                std::lock_guard<std::mutex> lck(downsamplingMutex);
+                auto it = downsamplingCounter.emplace((static_cast<uint64_t>(channel) << 32) | static_cast<uint32_t>(id), downsampling[id]).first;
+                it->second = it->second - 1;
+                if (it->second == 0) {
+                    // Reset counter and forward Envelope.
+                    it->second = downsampling[id];
+                    retVal = true;
+                }
+            }
+            else {
+                if ( (0 < mapOfEnvelopesToKeep.size()) && mapOfEnvelopesToKeep.count(id) ) {
+                    retVal = true;
+                }
+                if ( (0 < mapOfEnvelopesToDrop.size()) && !mapOfEnvelopesToDrop.count(id) ) {
+                    retVal = true;
+                }
+            }
+            return retVal;
+        };
+
+        // Serialize an Envelope to be relayed and mark it with the number of relays it has passed.
+        auto serializeRelayedEnvelope = [MAX_HOPS](cluon::data::Envelope &&env, uint32_t hops){
+            std::string serializedEnvelope{cluon::serializeEnvelope(std::move(env))};
+            if (0 < MAX_HOPS) {
+                serializedEnvelope = od4::withHopCount(std::move(serializedEnvelope), hops + 1);
+            }
+            return serializedEnvelope;
+        };
+
+        std::unordered_map<int32_t, uint32_t, cluon::UseUInt32ValueAsHashKey> priorityClasses{};
+        uint32_t numberOfPriorityClasses{0};
+        uint32_t defaultPriorityClass{0};
+        std::vector<uint32_t> priorityWeights{};
+        {
+            std::string tmp{commandlineArguments["priority"]};
+            if (!tmp.empty()) {
+                bool hasDefaultPriorityClass{false};
+                tmp += ",";
+                auto entries = stringtoolbox::split(tmp, ',');
+                for (auto e : entries) {
+                    auto l = stringtoolbox::split(e, ':');
+                    if ( (2 == l.size()) && (std::stoi(l[1]) >= 0) ) {
+                        const uint32_t PRIORITY_CLASS{static_cast<uint32_t>(std::stoi(l[1]))};
+                        std::clog << argv[0] << " relaying Envelopes with id " << l[0] << " with priority class " << PRIORITY_CLASS << std::endl;
+                        if ("*" == l[0]) {
+                            hasDefaultPriorityClass = true;
+                            defaultPriorityClass = PRIORITY_CLASS;
+                        }
+                        else {
+                            priorityClasses[std::stoi(l[0])] = PRIORITY_CLASS;
+                        }
+                        numberOfPriorityClasses = std::max(numberOfPriorityClasses, PRIORITY_CLASS + 1);
+                    }
+                }
+                if (!hasDefaultPriorityClass) {
+                    // Not listed IDs have the lowest priority.
+                    defaultPriorityClass = numberOfPriorityClasses++;
+                }
+            }
+            tmp = commandlineArguments["priority-weights"];
+            if (!tmp.empty() && (0 < numberOfPriorityClasses)) {
+                tmp += ",";
+                auto entries = stringtoolbox::split(tmp, ',');
+                for (auto e : entries) {
+                    if (!e.empty()) {
+                        priorityWeights.push_back(static_cast<uint32_t>(std::stoi(e)));
+                    }
+                }
+                std::clog << argv[0] << " serving " << numberOfPriorityClasses << " priority classes weighted by " << commandlineArguments["priority-weights"] << std::endl;
+            }
+        }
+        constexpr std::size_t MAX_ENVELOPES_PER_PRIORITY_CLASS{10000};
+        std::vector<std::unique_ptr<PriorityDispatcher<ReceivedEnvelope>>> dispatchers;
+
+        // Check the raw bytes received from --cid-from whether the Envelope has passed
+        // too many relays already or is to be shed, and determine its priority class
+        // and worker; all Envelopes of a --downsample-sync group go to the same worker.
+        auto admitEnvelope = [&argv, MAX_HOPS, &overloadController, &dispatchers, &priorityClasses, defaultPriorityClass, WORKERS, &synchronizedDownsampler](ReceivedEnvelope &re){
+            if ( !od4::peek(re.data.data(), re.data.size(), re.info) || ( (0 < MAX_HOPS) && (MAX_HOPS <= re.info.hops) ) ) {
+                return false;
+            }
+            if (overloadController) {
+                const auto NOW{std::chrono::system_clock::now()};
+                const int64_t LAG{std::chrono::duration_cast<std::chrono::microseconds>(NOW - re.timepoint).count()};
+                std::size_t queueDepth{0};
+                for (auto &d : dispatchers) {
+                    queueDepth += d->size();
+                }
+                if (overloadController->update(LAG, queueDepth, cluon::time::toMicroseconds(cluon::time::convert(NOW)))) {
+                    std::clog << argv[0] << " overload: " << overloadController->level() << " --shed entries active (lag: " << overloadController->lagInMicroseconds()/1000 << "ms, backlog: " << overloadController->backlog() << " Envelopes)" << std::endl;
+                }
+                if (overloadController->isToBeShed(re.info.dataType)) {
+                    return false;
+                }
+            }
+            auto it = priorityClasses.find(re.info.dataType);
+            re.priorityClass = (it != priorityClasses.end()) ? it->second : defaultPriorityClass;
+            if (1 < WORKERS) {
+                const uint64_t KEY{synchronizedDownsampler.isSynchronized(re.info.dataType)
+                                   ? (static_cast<uint64_t>(static_cast<uint32_t>(synchronizedDownsampler.referenceOf(re.info.dataType))) << 32)
+                                   : ((static_cast<uint64_t>(static_cast<uint32_t>(re.info.dataType)) << 32) | re.info.senderStamp)};
+                re.worker = static_cast<std::size_t>(((KEY * 0x9E3779B97F4A7C15ULL) >> 32) % WORKERS);
+            }
+            return true;
+        };
+
+        // Decode the raw bytes into an Envelope unless it is a duplicate, which is detected on the raw
+        // bytes, and relay it according to --downsample-sync, --keep, --drop, and --downsample; mimics cluon::OD4Session.
+        using RelayDelegate = std::function<void(cluon::data::Envelope &&env, uint32_t hops, uint32_t priorityClass, uint32_t channel)>;
+        auto decodeEnvelope = [&argv, &deduplicators, &synchronizedDownsampler, &isToBeRelayed](ReceivedEnvelope &&re, const RelayDelegate &relay){
+            if (0 >= re.info.dataType) {
+                return;
+            }
+            if (!deduplicators.empty()) {
+                auto &deduplicator = deduplicators[re.worker];
+                const uint64_t EVICTED{deduplicator->evictedWithinWindow()};
+                const bool IS_DUPLICATE{deduplicator->isDuplicate(re.data.data(), re.data.size(), re.channel, cluon::time::toMicroseconds(cluon::time::convert(re.timepoint)))};
+                // Report the first time and then at every power of two so that the log is not flooded.
+                const uint64_t NOW_EVICTED{deduplicator->evictedWithinWindow()};
+                if ( (EVICTED != NOW_EVICTED) && (0 == (NOW_EVICTED & (NOW_EVICTED - 1))) ) {
+                    std::clog << argv[0] << " forgot " << NOW_EVICTED << " Envelopes within the --dedup window as more were remembered; raise its maximum entries" << std::endl;
+                }
+                if (IS_DUPLICATE) {
+                    return;
+                }
+            }
+            std::stringstream sstr(std::move(re.data));
+            auto retVal = cluon::extractEnvelope(sstr);
+            if (retVal.first) {
+                cluon::data::Envelope env{retVal.second};
+                env.received(cluon::time::convert(re.timepoint));
+                if (synchronizedDownsampler.isSynchronized(env.dataType())) {
+                    synchronizedDownsampler.process(std::move(env), re.info.hops, re.priorityClass, re.channel, relay);
+                }
+                else if (isToBeRelayed(env, re.channel)) {
+                    relay(std::move(env), re.info.hops, re.priorityClass, re.channel);
+                }
+            }
+        };
+
+        // Copy a sample of everything received from --cid-from to a monitoring CID.
+        std::unique_ptr<cluon::UDPSender> mirrorDestination{nullptr};
+        uint32_t mirrorRatio{1};
+        bool isRandomMirror{false};
+        if (0 < commandlineArguments.count("mirror")) {
+            auto l = stringtoolbox::split(commandlineArguments["mirror"], ':');
+            if ( (2 <= l.size()) && (std::stoi(l[1]) > 0) && (CIDS_FROM.end() == std::find(CIDS_FROM.begin(), CIDS_FROM.end(), l[0])) ) {
+                mirrorRatio = static_cast<uint32_t>(std::stoi(l[1]));
+                isRandomMirror = ( (3 == l.size()) && ("random" == l[2]) );
+                std::clog << argv[0] << " mirroring " << (isRandomMirror ? "randomly " : "") << "every " << mirrorRatio << "-th Envelope to CID " << l[0] << std::endl;
+                mirrorDestination = std::make_unique<cluon::UDPSender>("225.0.0." + l[0], 12175);
+            }
+            else {
+                std::cerr << argv[0] << " ignoring --mirror=" << commandlineArguments["mirror"] << " (expecting <CID different from --cid-from>:<N>[:random])" << std::endl;
+            }
+        }
+        uint32_t mirrorCounter{0};
+        std::minstd_rand mirrorRandomNumberGenerator{std::random_device{}()};
+        std::uniform_int_distribution<uint32_t> mirrorDistribution{0, mirrorRatio - 1};
+        auto mirrorEnvelope = [&mirrorDestination, mirrorRatio, isRandomMirror, &mirrorCounter, &mirrorRandomNumberGenerator, &mirrorDistribution](const std::string &data){
+            if (mirrorDestination) {
+                const bool SEND{isRandomMirror ? (0 == mirrorDistribution(mirrorRandomNumberGenerator)) : (0 == mirrorCounter)};
+                mirrorCounter = (mirrorCounter + 1) % mirrorRatio;
+                if (SEND) {
+                    mirrorDestination->send(std::string(data));
+                }
+            }
+        };
+
+        // Create the delegate for the UDPReceiver on --cid-from that relays Envelopes
+        // either directly or, when using --priority or --workers, via the dispatcher
+        // threads; the optional isRelaying allows to skip relaying while nobody is receiving.
+        // The UDPReceivers of several CIDs share the dispatchers and take turns
+        // in processing their Envelopes, which are tagged with the channel of their CID.
+        const bool IS_MULTIPLEXING{1 < CIDS_FROM.size()};
+        std::mutex sourceMutex;
+        auto createSourceDelegate = [numberOfPriorityClasses, &priorityWeights, MAX_ENVELOPES_PER_PRIORITY_CLASS, WORKERS, IS_MULTIPLEXING, &sourceMutex, &dispatchers, &admitEnvelope, &decodeEnvelope, &mirrorEnvelope](RelayDelegate relay, std::function<bool()> isRelaying, uint32_t channel){
+            if ( ( (0 < numberOfPriorityClasses) || (1 < WORKERS) ) && dispatchers.empty() ) {
+                for (uint32_t i{0}; i < WORKERS; i++) {
+                    dispatchers.emplace_back(std::make_unique<PriorityDispatcher<ReceivedEnvelope>>(std::max<uint32_t>(numberOfPriorityClasses, 1), priorityWeights, MAX_ENVELOPES_PER_PRIORITY_CLASS,
+                        [relay, &decodeEnvelope](ReceivedEnvelope &&re){
+                            decodeEnvelope(std::move(re), relay);
+                        }));
+                }
+            }
+            return [relay, isRelaying, channel, IS_MULTIPLEXING, &sourceMutex, &dispatchers, &admitEnvelope, &decodeEnvelope, &mirrorEnvelope](std::string &&data, std::string &&/*from*/, std::chrono::system_clock::time_point &&timepoint){
+                std::unique_lock<std::mutex> lck(sourceMutex, std::defer_lock);
+                if (IS_MULTIPLEXING) {
+                    lck.lock();
+                }
+                mirrorEnvelope(data);
+                if ( (nullptr != isRelaying) && !isRelaying() ) {
+                    return;
+                }
+                ReceivedEnvelope re;
+                re.data = std::move(data);
+                re.timepoint = timepoint;
+                re.channel = channel;
+                if (admitEnvelope(re)) {
+                    if (!dispatchers.empty()) {
+                        const std::size_t WORKER{re.worker};
+                        dispatchers[WORKER]->push(re.priorityClass, std::move(re));
+                    }
+                    else {
+                        decodeEnvelope(std::move(re), relay);
+                    }
+                }
+            };
+        };
+
+        // Open a UDPReceiver for every CID of --cid-from; all of them relay via the same delegate.
+        auto openSources = [&CIDS_FROM, &createSourceDelegate](RelayDelegate relay, std::function<bool()> isRelaying){
+            std::vector<std::unique_ptr<cluon::UDPReceiver>> sources;
+            for (uint32_t channel{0}; channel < CIDS_FROM.size(); channel++) {
+                sources.emplace_back(std::make_unique<cluon::UDPReceiver>("225.0.0." + CIDS_FROM[channel], 12175, createSourceDelegate(relay, isRelaying, channel)));
+            }
+            return sources;
+        };
+        auto isRunning = [](const std::vector<std::unique_ptr<cluon::UDPReceiver>> &sources){
+            bool retVal{!sources.empty()};
+            for (const auto &s : sources) {
+                retVal &= s->isRunning();
+            }
+            return retVal;
+        };
+
         const bool VIA_TCP{commandlineArguments.count("via-tcp") != 0};
         if (VIA_TCP) {
             const std::string TCP{commandlineArguments["via-tcp"]};
-            const uint32_t MTU{(0 < commandlineArguments.count("mtu")) ? static_cast<uint32_t>(std::stoi(commandlineArguments["mtu"])) : 1};
+            // Batches are limited by the memory needed per client queue rather than by the size of a TCP packet.
+            constexpr std::size_t MAX_MTU{16 * 1024 * 1024};
+            std::size_t MTU{(0 < commandlineArguments.count("mtu")) ? static_cast<std::size_t>(std::max(1, std::stoi(commandlineArguments["mtu"]))) : 1};
+            if (MAX_MTU < MTU) {
+                std::clog << argv[0] << " limiting --mtu to " << MAX_MTU << " bytes" << std::endl;
+                MTU = MAX_MTU;
+            }
             uint32_t TIMEOUT{(0 < commandlineArguments.count("timeout")) ? static_cast<uint32_t>(std::stoi(commandlineArguments["timeout"])) : 1000};
             TIMEOUT = (0 == TIMEOUT) ? 1 : TIMEOUT;
+            const int64_t TIMEOUT_US{(0 < commandlineArguments.count("timeout-us")) ? std::max<int64_t>(1, std::stoll(commandlineArguments["timeout-us"])) : static_cast<int64_t>(TIMEOUT) * 1000};
+
+            // With --adaptive, --mtu is the upper limit for the batch size.
+            std::unique_ptr<AdaptiveBatching> adaptiveBatching{nullptr};
+            if (0 < commandlineArguments.count("adaptive")) {
+                constexpr int64_t MIN_TIMEOUT_US{50};
+                MTU = (0 < commandlineArguments.count("mtu")) ? MTU : 1024 * 1024;
+                adaptiveBatching = std::make_unique<AdaptiveBatching>(MTU, MIN_TIMEOUT_US, std::max<int64_t>(MIN_TIMEOUT_US, std::stoll(commandlineArguments["adaptive"])));
+                std::clog << argv[0] << " adapting batches of up to " << MTU << " bytes to keep the latency below " << commandlineArguments["adaptive"] << "us" << std::endl;
+            }
+            // Envelopes are sent as differences to the previous Envelope of their stream.
+            const uint32_t KEYFRAME_INTERVAL{(0 < commandlineArguments.count("delta")) ? static_cast<uint32_t>(std::max(1, std::stoi(commandlineArguments["delta"]))) : 0};
+            if (0 < KEYFRAME_INTERVAL) {
+                std::clog << argv[0] << " sending Envelopes as differences with a keyframe every " << KEYFRAME_INTERVAL << " Envelopes per stream" << std::endl;
+            }
+            // Envelopes in a batch may share their header, stream identification, and base time.
+            const bool COMPACT{0 < commandlineArguments.count("compact")};
+            // Batches are compressed as long as this is faster than sending them uncompressed over a link of the given rate.
+            const double LINK_RATE{(0 < commandlineArguments.count("compress")) ? std::max(0.001, std::stod(commandlineArguments["compress"])) : 0.0};
+            if (0.0 < LINK_RATE) {
+                std::clog << argv[0] << " compressing batches for a link of " << LINK_RATE << "Mbit/s" << std::endl;
+            }
+
+            // Batches are shaped to a maximum rate in kbit/s with a burst size in KiB; beyond that,
+            // Envelopes of the lowest priority classes are conflated (--overflow=conflate) or dropped.
+            double MAX_BANDWIDTH{0.0};
+            std::size_t BURST_SIZE{0};
+            if (0 < commandlineArguments.count("max-bandwidth")) {
+                const std::string tmp{commandlineArguments["max-bandwidth"]};
+                const std::size_t COLON{tmp.find(':')};
+                MAX_BANDWIDTH = std::max(1.0, std::stod(tmp.substr(0, COLON))) * 1000.0 / 8.0;
+                BURST_SIZE = (std::string::npos == COLON) ? static_cast<std::size_t>(MAX_BANDWIDTH / 10.0) : static_cast<std::size_t>(std::max(1, std::stoi(tmp.substr(COLON + 1)))) * 1024;
+                if (BURST_SIZE < MTU) {
+                    // A full batch must fit into the bucket.
+                    BURST_SIZE = MTU;
+                    std::clog << argv[0] << " using a burst size of " << BURST_SIZE << " bytes to hold one batch of --mtu" << std::endl;
+                }
+                std::clog << argv[0] << " shaping every TCP stream to " << MAX_BANDWIDTH * 8.0 / 1000.0 << "kbit/s with bursts of up to " << BURST_SIZE << " bytes" << std::endl;
+            }
+            const bool IS_CONFLATING{(0 < commandlineArguments.count("overflow")) && ("conflate" == commandlineArguments["overflow"])};
+            auto priorityClassOf = [&priorityClasses, numberOfPriorityClasses, defaultPriorityClass](int32_t dataType){
+                if (0 == numberOfPriorityClasses) {
+                    return uint32_t{1};
+                }
+                auto it = priorityClasses.find(dataType);
+                return (it != priorityClasses.end()) ? it->second : defaultPriorityClass;
+            };
+
+            // Create the shaping for the batches sent in one direction of the TCP connection, if any;
+            // it is kept by the caller to report the bytes that were dropped.
+            auto createBandwidthShaper = [MAX_BANDWIDTH, BURST_SIZE, IS_CONFLATING, priorityClassOf](){
+                return std::shared_ptr<BandwidthShaper>{(0.0 < MAX_BANDWIDTH) ? std::make_shared<BandwidthShaper>(MAX_BANDWIDTH, BURST_SIZE, IS_CONFLATING, priorityClassOf) : nullptr};
+            };
+
+            // Create the encoding for the batches sent in one direction of the TCP connection.
+            auto createBatchEncoder = [KEYFRAME_INTERVAL, COMPACT, LINK_RATE](std::shared_ptr<BandwidthShaper> bandwidthShaper){
+                std::shared_ptr<delta::DeltaEncoder> deltaEncoder{(0 < KEYFRAME_INTERVAL) ? std::make_shared<delta::DeltaEncoder>(KEYFRAME_INTERVAL) : nullptr};
+                std::shared_ptr<BatchCompressor> batchCompressor{(0.0 < LINK_RATE) ? std::make_shared<BatchCompressor>(LINK_RATE * 1000.0 * 1000.0 / 8.0) : nullptr};
+                return [bandwidthShaper, deltaEncoder, COMPACT, batchCompressor](std::vector<od4::SharedFrame> &batch){
+                    if (bandwidthShaper) {
+                        bandwidthShaper->process(batch, cluon::time::toMicroseconds(cluon::time::now()));
+                        if (batch.empty()) {
+                            return;
+                        }
+                    }
+                    if (deltaEncoder) {
+                        deltaEncoder->process(batch);
+                    }
+                    if (COMPACT) {
+                        compact::pack(batch);
+                    }
+                    if (batchCompressor) {
+                        batchCompressor->process(batch);
+                    }
+                };
+            };
+
+            // Envelopes of the highest priority class are not kept waiting for the batch to fill up;
+            // with several CIDs, the batches are shared and their Envelopes are tagged with their channel.
+            const bool HAS_PRIORITY_CLASSES{0 < numberOfPriorityClasses};
+            auto createBatchRelay = [HAS_PRIORITY_CLASSES, IS_MULTIPLEXING, &serializeRelayedEnvelope](BatchAssembler &batches){
+                return [HAS_PRIORITY_CLASSES, IS_MULTIPLEXING, &batches, &serializeRelayedEnvelope](cluon::data::Envelope &&env, uint32_t hops, uint32_t priorityClass, uint32_t channel){
+                    if (IS_MULTIPLEXING) {
+                        batches.add(serializeRelayedEnvelope(std::move(env), hops), HAS_PRIORITY_CLASSES && (0 == priorityClass), channel);
+                    }
+                    else {
+                        batches.add(serializeRelayedEnvelope(std::move(env), hops), HAS_PRIORITY_CLASSES && (0 == priorityClass));
+                    }
+                };
+            };
+
+            // Envelopes received on channel n are relayed to the n-th CID of --cid-to.
+            auto openDestinations = [&CIDS_TO](){
+                std::vector<std::unique_ptr<MulticastSender>> destinations;
+                for (const auto &cid : CIDS_TO) {
+                    destinations.emplace_back(std::make_unique<MulticastSender>("225.0.0." + cid, 12175));
+                }
+                return destinations;
+            };
+
             uint16_t port{0};
             try {
                 port = std::stoi(TCP);
@@ -131,28 +634,152 @@ int32_t main(int32_t argc, char **argv) {
             const bool IS_CLIENT{!NOT_IS_SERVER && (2 == connection.size())};
             const bool IS_SERVER{!NOT_IS_CLIENT && (1023 < port)};
             if (IS_CLIENT && !IS_SERVER) {
+                // With --subscribe, the server sends only the listed Envelopes: ID[/senderStamp][@Hz].
+                std::vector<subscription::Entry> subscriptionEntries;
+                if (0 < commandlineArguments.count("subscribe")) {
+                    std::string tmp{commandlineArguments["subscribe"]};
+                    tmp += ",";
+                    for (auto e : stringtoolbox::split(tmp, ',')) {
+                        if (e.empty()) {
+                            continue;
+                        }
+                        subscription::Entry entry;
+                        try {
+                            std::size_t pos{0};
+                            entry.dataType = std::stoi(e, &pos);
+                            if ( (pos < e.size()) && ('/' == e[pos]) ) {
+                                e = e.substr(pos + 1);
+                                entry.senderStamp = static_cast<uint32_t>(std::stoul(e, &pos));
+                                entry.isAnySenderStamp = false;
+                            }
+                            if ( (pos < e.size()) && ('@' == e[pos]) ) {
+                                const double RATE{std::stod(e.substr(pos + 1), &pos)};
+                                entry.minimumIntervalInMicroseconds = (0.0 < RATE) ? static_cast<uint64_t>(1000.0 * 1000.0 / RATE) : 0;
+                                pos = e.size();
+                            }
+                            if (pos != e.size()) {
+                                throw std::invalid_argument(e);
+                            }
+                            subscriptionEntries.push_back(entry);
+                        }
+                        catch (...) {
+                            std::cerr << argv[0] << " ignoring '" << e << "' in --subscribe (expecting ID[/senderStamp][@Hz])" << std::endl;
+                        }
+                    }
+                }
+
                 try {
                     port = std::stoi(connection[1]);
 
-                    cluon::TCPConnection c(connection[0], port);
-                    if (c.isRunning()) {
-                        cluon::UDPSender od4Destination{"225.0.0." + commandlineArguments["cid-to"], 12175};
-
-                        c.setOnNewData([&od4Destination](std::string &&d, std::chrono::system_clock::time_point && /*timestamp*/) {
-                            // Unpack multiple Envelopes.
-                            std::stringstream sstr(std::move(d));
-                            while (sstr.good()) {
-                                auto retVal = cluon::extractEnvelope(sstr);
-                                if (retVal.first) {
-                                    od4Destination.send(cluon::serializeEnvelope(std::move(retVal.second)));
+                    auto od4Destinations{openDestinations()};
+                    std::size_t UPSTREAM_QUEUE{static_cast<std::size_t>((0 < commandlineArguments.count("client-queue")) ? std::max(1, std::stoi(commandlineArguments["client-queue"])) : 4096) * 1024};
+                    if (!CIDS_FROM.empty() && (UPSTREAM_QUEUE < 2 * MTU)) {
+                        // The queue must hold the batch being sent and the next one.
+                        UPSTREAM_QUEUE = 2 * MTU;
+                        std::clog << argv[0] << " using " << UPSTREAM_QUEUE / 1024 << "KiB for the queue to the server to hold two batches of --mtu" << std::endl;
+                    }
+
+                    // The client reconnects with an increasing delay when the connection is lost and resumes
+                    // its session if the server keeps batches to replay (--replay).
+                    session::Tracker sessionTracker{std::random_device{}() | (static_cast<uint64_t>(std::random_device{}()) << 32)};
+                    constexpr int64_t MIN_RECONNECT_DELAY_MS{100};
+                    constexpr int64_t MAX_RECONNECT_DELAY_MS{10 * 1000};
+                    int64_t reconnectDelay{MIN_RECONNECT_DELAY_MS};
+                    while (!cluon::TerminateHandler::instance().isTerminated.load()) {
+                        // Envelopes may be split across the chunks received from the TCP connection.
+                        EnvelopeRestorer envelopeRestorer;
+                        cluon::TCPConnection c(connection[0], port);
+                        if (c.isRunning()) {
+                            std::clog << argv[0] << " connected to " << TCP << std::endl;
+                            reconnectDelay = MIN_RECONNECT_DELAY_MS;
+                            const std::string RESUME{sessionTracker.connect()};
+
+                            // A batch is sent in several chunks; no other frame must get in between them.
+                            std::mutex sendMutex;
+
+                            // Forward the Envelopes exactly as received from the server, including the
+                            // hop count; only their top-level fields are checked, nothing is decoded.
+                            c.setOnNewData([&od4Destinations, &envelopeRestorer, &sessionTracker](std::string &&data, std::chrono::system_clock::time_point && /*timestamp*/) {
+                                envelopeRestorer.restore(data.data(), data.size(), [&od4Destinations, &sessionTracker](uint32_t channel, const char *envelope, std::size_t length) {
+                                    if ( sessionTracker.isAccepting() && (channel < od4Destinations.size()) ) {
+                                        od4Destinations[channel]->queue(envelope, length);
+                                    }
+                                },
+                                [&sessionTracker](const char *frame, std::size_t length) {
+                                    sessionTracker.onExtension(frame, length);
+                                });
+                                for (auto &d : od4Destinations) {
+                                    d->flush();
+                                }
+                            });
+                            {
+                                std::lock_guard<std::mutex> lck(sendMutex);
+                                if (!subscriptionEntries.empty()) {
+                                    c.send(subscription::frame(subscriptionEntries));
+                                }
+                                if (!RESUME.empty()) {
+                                    c.send(std::string(RESUME));
                                 }
                             }
-                        });
 
-                        using namespace std::literals::chrono_literals;
-                        while (c.isRunning()) {
-                            std::this_thread::sleep_for(1s);
+                            // With --cid-from, Envelopes from there are relayed to the server on the same connection;
+                            // while the connection stalls, at most UPSTREAM_QUEUE bytes of batches wait to be sent.
+                            std::unique_ptr<BatchAssembler> batches{nullptr};
+                            auto bandwidthShaper{createBandwidthShaper()};
+                            std::vector<std::unique_ptr<cluon::UDPReceiver>> od4Sources;
+                            if (!CIDS_FROM.empty()) {
+                                batches = std::make_unique<BatchAssembler>(MTU, TIMEOUT_US, [&argv, &c, &sendMutex, encodeBatch = createBatchEncoder(bandwidthShaper)](std::vector<od4::SharedFrame> &&batch){
+                                    encodeBatch(batch);
+                                    std::string data;
+                                    for (const auto &f : batch) {
+                                        data.append(*f);
+                                    }
+                                    // TCPConnection sends at most 64KiB at once and may send less.
+                                    constexpr std::size_t MAX_CHUNK{65535};
+                                    std::lock_guard<std::mutex> lck(sendMutex);
+                                    for (std::size_t pos{0}; pos < data.size(); ) {
+                                        auto result = c.send(data.substr(pos, MAX_CHUNK));
+                                        if (0 >= result.first) {
+                                            if (c.isRunning()) {
+                                                std::cerr << argv[0] << ": could not send " << data.size() - pos << " bytes to the server: " << std::strerror(result.second) << std::endl;
+                                            }
+                                            break;
+                                        }
+                                        pos += static_cast<std::size_t>(result.first);
+                                    }
+                                }, UPSTREAM_QUEUE);
+                                od4Sources = openSources(createBatchRelay(*batches), [&c](){
+                                    return c.isRunning();
+                                });
+                            }
+
+                            // The received batches are acknowledged periodically.
+                            using namespace std::literals::chrono_literals;
+                            while (c.isRunning()) {
+                                std::this_thread::sleep_for(100ms);
+                                std::string ack{sessionTracker.ackFrame()};
+                                if (!ack.empty()) {
+                                    std::lock_guard<std::mutex> lck(sendMutex);
+                                    c.send(std::move(ack));
+                                }
+                            }
+
+                            // Relay what the dispatchers still hold before sending the last batch.
+                            od4Sources.clear();
+                            dispatchers.clear();
+                            if (batches && (0 < batches->bytesDropped())) {
+                                std::clog << argv[0] << " dropped " << batches->bytesDropped() << " bytes for " << TCP << " while the connection stalled" << std::endl;
+                            }
+                            batches.reset();
+                            if (bandwidthShaper && (0 < bandwidthShaper->bytesDropped())) {
+                                std::clog << argv[0] << " dropped " << bandwidthShaper->bytesDropped() << " bytes for " << TCP << " to stay within --max-bandwidth" << std::endl;
+                            }
+                            std::clog << argv[0] << " lost connection to " << TCP << std::endl;
                         }
+                        for (int64_t slept{0}; (slept < reconnectDelay) && !cluon::TerminateHandler::instance().isTerminated.load(); slept += MIN_RECONNECT_DELAY_MS) {
+                            std::this_thread::sleep_for(std::chrono::milliseconds(MIN_RECONNECT_DELAY_MS));
+                        }
+                        reconnectDelay = std::min(2 * reconnectDelay, MAX_RECONNECT_DELAY_MS);
                     }
                 }
                 catch (...) {
@@ -160,97 +787,386 @@ int32_t main(int32_t argc, char **argv) {
                 }
             }
             else if (!IS_CLIENT && IS_SERVER) {
-                std::vector<std::shared_ptr<cluon::TCPConnection>> connections;
+                std::size_t CLIENT_QUEUE{static_cast<std::size_t>((0 < commandlineArguments.count("client-queue")) ? std::max(1, std::stoi(commandlineArguments["client-queue"])) : 4096) * 1024};
+                if (CLIENT_QUEUE < 2 * MTU) {
+                    // A client's queue must hold the batch being sent and the next one.
+                    CLIENT_QUEUE = 2 * MTU;
+                    std::clog << argv[0] << " using " << CLIENT_QUEUE / 1024 << "KiB per client queue to hold two batches of --mtu" << std::endl;
+                }
+                std::string overflowPolicy{(0 < commandlineArguments.count("overflow")) ? commandlineArguments["overflow"] : "drop"};
 
-                auto newConnectionHandler = [&argv, &connections](std::string &&from, std::shared_ptr<cluon::TCPConnection> conn) noexcept {
-                    std::cout << argv[0] << ": new connection from " << from << std::endl;
-                    conn->setOnNewData([](std::string &&/*d*/, std::chrono::system_clock::time_point && /*timestamp*/) {});
-                    conn->setOnConnectionLost([]() {});
-                    connections.push_back(conn);
+                // With --cid-to, Envelopes from the clients are relayed there; as every client
+                // has its own stream of frames, every client has its own restorer.
+                auto od4Destinations{openDestinations()};
+                std::unordered_map<std::string, std::unique_ptr<EnvelopeRestorer>> envelopeRestorers;
+
+                // Clients that have subscribed get their own stream of the subscribed Envelopes,
+                // which is filtered and encoded separately from the stream for all other clients.
+                // While the batches of a resumed session are encoded on the replay thread, the batches
+                // relayed meanwhile wait with their sequence frame to be encoded after them.
+                using PendingBatch = std::pair<od4::SharedFrame, std::vector<od4::SharedFrame>>;
+                struct Subscriber {
+                    std::unique_ptr<subscription::Filter> filter{nullptr};
+                    std::shared_ptr<BandwidthShaper> bandwidthShaper{nullptr};
+                    std::function<void(std::vector<od4::SharedFrame>&)> encodeBatch{nullptr};
+                    bool isResuming{false};
+                    std::vector<PendingBatch> pendingBatches{};
+                };
+                std::unordered_map<std::string, std::shared_ptr<Subscriber>> subscribers;
+                auto encodeForSubscriber = [](Subscriber &subscriber, const od4::SharedFrame &sequenceFrame, const std::vector<od4::SharedFrame> &batch, int64_t now, std::vector<od4::SharedFrame> &out){
+                    auto frames{subscriber.filter->apply(batch, now)};
+                    if (!frames.empty()) {
+                        subscriber.encodeBatch(frames);
+                        if (sequenceFrame) {
+                            out.push_back(sequenceFrame);
+                        }
+                        out.insert(out.end(), frames.begin(), frames.end());
+                    }
                 };
-                cluon::TCPServer server(port, newConnectionHandler);
-
-                std::mutex bufferForEnvelopesMutex;
-                std::vector<char> bufferForEnvelopes;
-                bufferForEnvelopes.reserve(65535);
-                uint16_t indexBufferForEnvelopes{0};
-                auto bufferOrSendEnvelope = [MTU, &connections, &bufferForEnvelopesMutex, &bufferForEnvelopes, &indexBufferForEnvelopes](cluon::data::Envelope &&env){
-                    const std::string serializedEnvelope{cluon::serializeEnvelope(std::move(env))};
-                    const auto LENGTH{serializedEnvelope.size()};
-
-                    std::lock_guard<std::mutex> lck(bufferForEnvelopesMutex);
-                    // Do we have to clear the buffer first?
-                    if ( (0 < indexBufferForEnvelopes) && (MTU < (indexBufferForEnvelopes + LENGTH)) ) {
-                        for(auto c: connections) {
-                            c->send(std::string(bufferForEnvelopes.data(), indexBufferForEnvelopes));
+
+                // With --snapshot, new clients get the last Envelope of every stream of the listed IDs first.
+                std::unique_ptr<SnapshotCache> snapshotCache{nullptr};
+                if (0 < commandlineArguments.count("snapshot")) {
+                    constexpr uint32_t DEFAULT_STREAMS_PER_ID{16};
+                    std::unordered_map<int32_t, uint32_t> maxStreamsPerDataType;
+                    std::string tmp{commandlineArguments["snapshot"]};
+                    tmp += ",";
+                    for (auto e : stringtoolbox::split(tmp, ',')) {
+                        if (e.empty()) {
+                            continue;
+                        }
+                        try {
+                            const std::size_t COLON{e.find(':')};
+                            const int32_t ID{std::stoi(e.substr(0, COLON))};
+                            maxStreamsPerDataType[ID] = (std::string::npos == COLON) ? DEFAULT_STREAMS_PER_ID : static_cast<uint32_t>(std::max(1, std::stoi(e.substr(COLON + 1))));
+                            std::clog << argv[0] << " caching the last Envelope of up to " << maxStreamsPerDataType[ID] << " senderStamps of id " << ID << " for new clients" << std::endl;
+                        }
+                        catch (...) {
+                            std::cerr << argv[0] << " ignoring '" << e << "' in --snapshot (expecting ID[:N])" << std::endl;
                         }
-                        indexBufferForEnvelopes = 0;
                     }
+                    snapshotCache = std::make_unique<SnapshotCache>(maxStreamsPerDataType);
+                }
 
-                    std::memcpy(bufferForEnvelopes.data() + indexBufferForEnvelopes, serializedEnvelope.data(), LENGTH);
-                    indexBufferForEnvelopes += LENGTH;
-                    // Do we have to clear the buffer again?
-                    if (MTU < indexBufferForEnvelopes) {
-                        for(auto c: connections) {
-                            c->send(std::string(bufferForEnvelopes.data(), indexBufferForEnvelopes));
+                // The snapshot waits for the client's first frame so that it can be filtered by the client's
+                // subscription, which is sent right after connecting; it leaves out the streams that the client
+                // received live meanwhile. Clients that send nothing get it after SNAPSHOT_DELAY_US.
+                constexpr int64_t SNAPSHOT_DELAY_US{100 * 1000};
+                struct PendingSnapshot {
+                    int64_t connected{0};
+                    uint64_t lastUpdate{0};
+                };
+                std::unordered_map<std::string, PendingSnapshot> pendingSnapshots;
+                auto takeSnapshot = [&snapshotCache, &pendingSnapshots](const std::string &from, subscription::Filter *filter) {
+                    std::vector<od4::SharedFrame> frames;
+                    auto it = pendingSnapshots.find(from);
+                    if (it != pendingSnapshots.end()) {
+                        frames = snapshotCache->snapshot(it->second.lastUpdate);
+                        pendingSnapshots.erase(it);
+                        if (nullptr != filter) {
+                            frames = filter->apply(frames, cluon::time::toMicroseconds(cluon::time::now()));
                         }
-                        indexBufferForEnvelopes = 0;
                     }
+                    return frames;
                 };
 
-                cluon::OD4Session od4Source(static_cast<uint16_t>(std::stoi(commandlineArguments["cid-from"])),
-                    [&connections, &bufferOrSendEnvelope, &mapOfEnvelopesToKeep, &mapOfEnvelopesToDrop, &downsampling, &downsamplingCounter](cluon::data::Envelope &&env){
-                        if (!connections.empty()) {
-                            auto id{env.dataType()};
-                            if (0 < id) {
-                                if ( downsampling.empty() && mapOfEnvelopesToKeep.empty() && mapOfEnvelopesToDrop.empty() ) {
-                                    bufferOrSendEnvelope(std::move(env));
+                // With --replay, batches are numbered and the most recent ones are kept so that clients
+                // can resume their session after reconnecting from the batch they acknowledged last.
+                std::unique_ptr<session::ReplayBuffer> replayBuffer{nullptr};
+                if (0 < commandlineArguments.count("replay")) {
+                    const std::size_t REPLAY_SIZE{static_cast<std::size_t>(std::max(1, std::stoi(commandlineArguments["replay"]))) * 1024};
+                    replayBuffer = std::make_unique<session::ReplayBuffer>(REPLAY_SIZE);
+                    std::clog << argv[0] << " keeping the last " << REPLAY_SIZE / 1024 << "KiB of batches to resume sessions" << std::endl;
+                    if (CLIENT_QUEUE < REPLAY_SIZE + 2 * MTU) {
+                        // A client's queue must hold the replayed batches and the next one.
+                        CLIENT_QUEUE = REPLAY_SIZE + 2 * MTU;
+                        std::clog << argv[0] << " using " << CLIENT_QUEUE / 1024 << "KiB per client queue to hold --replay" << std::endl;
+                    }
+                    if ("disconnect" != overflowPolicy) {
+                        // Batches dropped from a client's queue could not be resumed, but a disconnected client resumes them.
+                        if (0 < commandlineArguments.count("overflow")) {
+                            std::clog << argv[0] << " ignoring --overflow=" << overflowPolicy << " and disconnecting clients with a full queue to resume them with --replay" << std::endl;
+                        }
+                        overflowPolicy = "disconnect";
+                    }
+                }
+
+                // Batches are sent under this lock so that snapshots, replays, and subscriptions of
+                // new clients are never older than the live Envelopes they may have received already.
+                std::mutex streamMutex;
+
+                // Replayed batches are encoded on a thread of their own so that neither the clients' sockets
+                // nor the live batches wait for them; it is started once the connections are accepted and
+                // woken up when a resume is pending. Both flags are guarded by streamMutex.
+                std::condition_variable replayCondition;
+                bool isResumePending{false};
+                bool isReplaying{nullptr != replayBuffer};
+                std::thread replayThread;
+
+                // Every client has its own queue that is sent from a separate thread
+                // so that a slow client does neither block the others nor --cid-from;
+                // the kernel may take two large batches at once to save on system calls.
+                TCPFanout connections(port, CLIENT_QUEUE,
+                    ("conflate" == overflowPolicy) ? TCPFanout::OverflowPolicy::CONFLATE
+                                                   : (("disconnect" == overflowPolicy) ? TCPFanout::OverflowPolicy::DISCONNECT : TCPFanout::OverflowPolicy::DROP),
+                    (64 * 1024 < MTU) ? 2 * MTU : 0,
+                    [&argv, &snapshotCache, &streamMutex, &pendingSnapshots](const std::string &from) {
+                        std::cout << argv[0] << ": new connection from " << from << std::endl;
+                        if (snapshotCache) {
+                            std::lock_guard<std::mutex> lck(streamMutex);
+                            pendingSnapshots[from] = PendingSnapshot{cluon::time::toMicroseconds(cluon::time::now()), snapshotCache->updates()};
+                        }
+                    },
+                    [&argv, &envelopeRestorers, &streamMutex, &subscribers, &pendingSnapshots](const std::string &from) {
+                        std::cout << argv[0] << ": lost connection to " << from << std::endl;
+                        envelopeRestorers.erase(from);
+                        std::lock_guard<std::mutex> lck(streamMutex);
+                        auto it = subscribers.find(from);
+                        if (it != subscribers.end()) {
+                            if (it->second->bandwidthShaper && (0 < it->second->bandwidthShaper->bytesDropped())) {
+                                std::clog << argv[0] << " dropped " << it->second->bandwidthShaper->bytesDropped() << " bytes for " << from << " to stay within --max-bandwidth" << std::endl;
+                            }
+                            subscribers.erase(it);
+                        }
+                        pendingSnapshots.erase(from);
+                    },
+                    [&argv, &od4Destinations, &envelopeRestorers, &streamMutex, &subscribers, &snapshotCache, &pendingSnapshots, &takeSnapshot, &replayBuffer, &replayCondition, &isResumePending, &isReplaying, &connections, &createBandwidthShaper, &createBatchEncoder](const std::string &from, const char *data, std::size_t length) {
+                        auto &envelopeRestorer = envelopeRestorers[from];
+                        if (!envelopeRestorer) {
+                            envelopeRestorer = std::make_unique<EnvelopeRestorer>();
+                        }
+                        bool hasFrames{false};
+                        envelopeRestorer->restore(data, length, [&od4Destinations, &hasFrames](uint32_t channel, const char *envelope, std::size_t len) {
+                            hasFrames = true;
+                            if (channel < od4Destinations.size()) {
+                                od4Destinations[channel]->queue(envelope, len);
+                            }
+                        },
+                        [&argv, &from, &hasFrames, &streamMutex, &subscribers, &snapshotCache, &pendingSnapshots, &takeSnapshot, &replayBuffer, &replayCondition, &isResumePending, &isReplaying, &connections, &createBandwidthShaper, &createBatchEncoder](const char *frame, std::size_t len) {
+                            hasFrames = true;
+                            std::vector<subscription::Entry> entries;
+                            uint64_t values[2]{0, 0};
+                            if (subscription::parse(frame, len, entries)) {
+                                std::cout << argv[0] << ": " << from << " subscribed to " << entries.size() << " stream(s)" << std::endl;
+                                auto subscriber{std::make_shared<Subscriber>()};
+                                subscriber->filter = std::make_unique<subscription::Filter>(entries);
+                                subscriber->bandwidthShaper = createBandwidthShaper();
+                                subscriber->encodeBatch = createBatchEncoder(subscriber->bandwidthShaper);
+                                // Detach under the lock so that no batch reaches the client on both streams.
+                                std::lock_guard<std::mutex> lck(streamMutex);
+                                if (snapshotCache) {
+                                    auto snapshot{takeSnapshot(from, subscriber->filter.get())};
+                                    if (!snapshot.empty()) {
+                                        connections.sendTo(from, std::move(snapshot));
+                                    }
+                                }
+                                subscribers[from] = std::move(subscriber);
+                                connections.detach(from);
+                            }
+                            else if (session::parse(frame, len, od4::ExtensionType::ACK, values, 2)) {
+                                std::lock_guard<std::mutex> lck(streamMutex);
+                                if (replayBuffer) {
+                                    replayBuffer->acknowledge(values[0], values[1]);
                                 }
-                                else if ( (0 < downsampling.size()) && downsampling.count(env.dataType()) ) {
-                                    downsamplingCounter[id] = downsamplingCounter[id] - 1;
-                                    if (downsamplingCounter[id] == 0) {
-                                        // Reset counter and forward Envelope.
-                                        downsamplingCounter[id] = downsampling[id];
-                                        bufferOrSendEnvelope(std::move(env));
+                            }
+                            else if (session::parse(frame, len, od4::ExtensionType::RESUME, values, 1)) {
+                                std::lock_guard<std::mutex> lck(streamMutex);
+                                std::size_t numberOfBatches{0};
+                                bool isComplete{false};
+                                if (replayBuffer && isReplaying) {
+                                    // The replayed batches are encoded like the following ones, so the client gets a stream of its own.
+                                    auto &subscriber = subscribers[from];
+                                    if (!subscriber) {
+                                        subscriber = std::make_shared<Subscriber>();
+                                        subscriber->filter = std::make_unique<subscription::Filter>(std::vector<subscription::Entry>());
+                                        subscriber->bandwidthShaper = createBandwidthShaper();
+                                        subscriber->encodeBatch = createBatchEncoder(subscriber->bandwidthShaper);
+                                    }
+                                    connections.detach(from);
+
+                                    // Only the references to the batches are taken here; they are encoded on the replay thread.
+                                    std::vector<PendingBatch> replayed;
+                                    isComplete = !subscriber->isResuming && replayBuffer->replay(values[0], [&replayed](uint64_t sequence, const std::vector<od4::SharedFrame> &batch) {
+                                        replayed.emplace_back(std::make_shared<const std::string>(session::sequenceFrame(sequence)), batch);
+                                    });
+                                    if (isComplete && !replayed.empty()) {
+                                        numberOfBatches = replayed.size();
+                                        subscriber->pendingBatches = std::move(replayed);
+                                        subscriber->isResuming = true;
+                                        isResumePending = true;
+                                        replayCondition.notify_one();
                                     }
                                 }
-                                else {
-                                    if ( (0 < mapOfEnvelopesToKeep.size()) && mapOfEnvelopesToKeep.count(id) ) {
-                                        bufferOrSendEnvelope(std::move(env));
+                                std::cout << argv[0] << ": " << from << (isComplete ? " resumed its session, replaying " + std::to_string(numberOfBatches) + " batch(es)" : " could not resume its session") << std::endl;
+
+                                std::vector<od4::SharedFrame> frames{std::make_shared<const std::string>(session::resumeFrame(isComplete ? 1 : 0))};
+                                if (snapshotCache) {
+                                    // The client ignores the Envelopes before this answer, so its snapshot covers all streams.
+                                    pendingSnapshots.erase(from);
+                                    if (!isComplete) {
+                                        auto snapshot{snapshotCache->snapshot()};
+                                        auto it = subscribers.find(from);
+                                        if (it != subscribers.end()) {
+                                            snapshot = it->second->filter->apply(snapshot, cluon::time::toMicroseconds(cluon::time::now()));
+                                        }
+                                        frames.insert(frames.end(), snapshot.begin(), snapshot.end());
+                                    }
+                                }
+                                connections.sendTo(from, std::move(frames));
+                            }
+                        });
+                        if (hasFrames && snapshotCache) {
+                            std::lock_guard<std::mutex> lck(streamMutex);
+                            auto snapshot{takeSnapshot(from, nullptr)};
+                            if (!snapshot.empty()) {
+                                connections.sendTo(from, std::move(snapshot));
+                            }
+                        }
+                        for (auto &d : od4Destinations) {
+                            d->flush();
+                        }
+                    });
+                if (!connections.isRunning()) {
+                    std::cerr << argv[0] << ": could not listen on port " << port << std::endl;
+                    return 1;
+                }
+                if (replayBuffer) {
+                    // Every client that is resuming is served until no batches are left for it, which is
+                    // decided under the lock; the batches relayed meanwhile follow the replayed ones.
+                    replayThread = std::thread([&streamMutex, &replayCondition, &isResumePending, &isReplaying, &subscribers, &connections, &encodeForSubscriber](){
+                        std::unique_lock<std::mutex> lck(streamMutex);
+                        while (isReplaying) {
+                            replayCondition.wait(lck, [&isResumePending, &isReplaying](){
+                                return (isResumePending || !isReplaying);
+                            });
+                            isResumePending = false;
+                            std::vector<std::pair<std::string, std::shared_ptr<Subscriber>>> resuming;
+                            for (const auto &s : subscribers) {
+                                if (s.second->isResuming) {
+                                    resuming.emplace_back(s.first, s.second);
+                                }
+                            }
+                            for (auto &r : resuming) {
+                                std::vector<PendingBatch> pending;
+                                pending.swap(r.second->pendingBatches);
+                                r.second->isResuming = !pending.empty();
+                                while (!pending.empty() && isReplaying) {
+                                    lck.unlock();
+                                    std::vector<od4::SharedFrame> frames;
+                                    const int64_t NOW{cluon::time::toMicroseconds(cluon::time::now())};
+                                    for (const auto &b : pending) {
+                                        encodeForSubscriber(*r.second, b.first, b.second, NOW, frames);
                                     }
-                                    if ( (0 < mapOfEnvelopesToDrop.size()) && !mapOfEnvelopesToDrop.count(id) ) {
-                                        bufferOrSendEnvelope(std::move(env));
+                                    pending.clear();
+                                    lck.lock();
+
+                                    auto it = subscribers.find(r.first);
+                                    if ( (it == subscribers.end()) || (it->second != r.second) ) {
+                                        // The client is gone or subscribed again meanwhile.
+                                        break;
+                                    }
+                                    if (!frames.empty()) {
+                                        connections.sendTo(r.first, std::move(frames));
                                     }
+                                    pending.swap(r.second->pendingBatches);
+                                    r.second->isResuming = !pending.empty();
                                 }
                             }
                         }
+                    });
+                }
+
+                // Envelopes are collected in one batch while the previous one is handed to the clients;
+                // a batch is sent when it is full or TIMEOUT_US after its first Envelope.
+                auto bandwidthShaper{createBandwidthShaper()};
+                BatchAssembler batches(adaptiveBatching ? adaptiveBatching->batchSize() : MTU,
+                                       adaptiveBatching ? adaptiveBatching->timeoutInMicroseconds() : TIMEOUT_US,
+                                       [&connections, &streamMutex, &snapshotCache, &replayBuffer, &subscribers, &encodeForSubscriber, encodeBatch = createBatchEncoder(bandwidthShaper)](std::vector<od4::SharedFrame> &&batch){
+                    std::lock_guard<std::mutex> lck(streamMutex);
+                    if (snapshotCache) {
+                        snapshotCache->update(batch);
+                    }
+                    od4::SharedFrame sequenceFrame{nullptr};
+                    if (replayBuffer) {
+                        sequenceFrame = std::make_shared<const std::string>(session::sequenceFrame(replayBuffer->append(batch)));
+                    }
+
+                    const int64_t NOW{cluon::time::toMicroseconds(cluon::time::now())};
+                    for (auto &s : subscribers) {
+                        if (s.second->isResuming) {
+                            s.second->pendingBatches.emplace_back(sequenceFrame, batch);
+                            continue;
+                        }
+                        std::vector<od4::SharedFrame> frames;
+                        encodeForSubscriber(*s.second, sequenceFrame, batch, NOW, frames);
+                        if (!frames.empty()) {
+                            connections.sendTo(s.first, std::move(frames));
+                        }
                     }
-                );
-
-                const float FREQ{1000.0f/TIMEOUT};
-                od4Source.timeTrigger(FREQ, [&od4Source, MTU, &connections, &bufferForEnvelopesMutex, &bufferForEnvelopes, &indexBufferForEnvelopes](){
-                    std::lock_guard<std::mutex> lck(bufferForEnvelopesMutex);
-                    if (0 < indexBufferForEnvelopes) {
-                        for(auto c: connections) {
-                            c->send(std::string(bufferForEnvelopes.data(), indexBufferForEnvelopes));
+                    // Encoding is skipped while all clients have a stream of their own.
+                    if (subscribers.size() < connections.numberOfClients()) {
+                        encodeBatch(batch);
+                        if (sequenceFrame) {
+                            batch.insert(batch.begin(), sequenceFrame);
+                        }
+                        if (!batch.empty()) {
+                            connections.send(std::move(batch));
                         }
-                        indexBufferForEnvelopes = 0;
                     }
-                    return od4Source.isRunning();
                 });
 
-                // Clear buffer for the last time.
                 {
-                    std::lock_guard<std::mutex> lck(bufferForEnvelopesMutex);
-                    if (0 < indexBufferForEnvelopes) {
-                        for(auto c: connections) {
-                            c->send(std::string(bufferForEnvelopes.data(), indexBufferForEnvelopes));
+                    // The snapshot and the batches to replay are kept up to date even while there are no clients.
+                    auto od4Sources{openSources(createBatchRelay(batches), [&connections, &snapshotCache, &replayBuffer](){
+                        return (snapshotCache || replayBuffer || (0 < connections.numberOfClients()));
+                    })};
+
+                    using namespace std::literals::chrono_literals;
+                    while (isRunning(od4Sources)) {
+                        if (snapshotCache) {
+                            const int64_t NOW{cluon::time::toMicroseconds(cluon::time::now())};
+                            std::lock_guard<std::mutex> lck(streamMutex);
+                            std::vector<std::string> overdue;
+                            for (const auto &p : pendingSnapshots) {
+                                if (SNAPSHOT_DELAY_US <= NOW - p.second.connected) {
+                                    overdue.push_back(p.first);
+                                }
+                            }
+                            for (const auto &from : overdue) {
+                                auto snapshot{takeSnapshot(from, nullptr)};
+                                if (!snapshot.empty()) {
+                                    connections.sendTo(from, std::move(snapshot));
+                                }
+                            }
+                        }
+                        if (adaptiveBatching) {
+                            std::this_thread::sleep_for(100ms);
+                            adaptiveBatching->update(batches.bytesAdded(), connections.bytesSent(), connections.numberOfClients(), connections.backlog(),
+                                                     cluon::time::toMicroseconds(cluon::time::now()));
+                            batches.setLimits(adaptiveBatching->batchSize(), adaptiveBatching->timeoutInMicroseconds());
+                        }
+                        else {
+                            std::this_thread::sleep_for(snapshotCache ? 100ms : 1000ms);
                         }
-                        indexBufferForEnvelopes = 0;
                     }
                 }
 
-                connections.clear();
+                // Relay what the dispatchers still hold before sending the last batch.
+                dispatchers.clear();
+                batches.flush();
+
+                // Stop replaying before the connections are closed.
+                {
+                    std::lock_guard<std::mutex> lck(streamMutex);
+                    isReplaying = false;
+                    if (bandwidthShaper && (0 < bandwidthShaper->bytesDropped())) {
+                        std::clog << argv[0] << " dropped " << bandwidthShaper->bytesDropped() << " bytes for the clients without subscription to stay within --max-bandwidth" << std::endl;
+                    }
+                }
+                replayCondition.notify_one();
+                if (replayThread.joinable()) {
+                    replayThread.join();
+                }
             }
             else {
                 retCode = 1;
@@ -259,39 +1175,20 @@ int32_t main(int32_t argc, char **argv) {
         else {
             cluon::UDPSender od4Destination{"225.0.0." + commandlineArguments["cid-to"], 12175};
 
-            cluon::OD4Session od4Source(static_cast<uint16_t>(std::stoi(commandlineArguments["cid-from"])),
-                [&od4Destination, &mapOfEnvelopesToKeep, &mapOfEnvelopesToDrop, &downsampling, &downsamplingCounter](cluon::data::Envelope &&env){
-                    auto id{env.dataType()};
-                    if (0 < id) {
-                        if ( downsampling.empty() && mapOfEnvelopesToKeep.empty() && mapOfEnvelopesToDrop.empty() ) {
-                            od4Destination.send(cluon::serializeEnvelope(std::move(env)));
-                        }
-                        else if ( (0 < downsampling.size()) && downsampling.count(env.dataType()) ) {
-                            downsamplingCounter[id] = downsamplingCounter[id] - 1;
-                            if (downsamplingCounter[id] == 0) {
-                                // Reset counter and forward Envelope.
-                                downsamplingCounter[id] = downsampling[id];
-                                od4Destination.send(cluon::serializeEnvelope(std::move(env)));
-                            }
-                        }
-                        else {
-                            if ( (0 < mapOfEnvelopesToKeep.size()) && mapOfEnvelopesToKeep.count(id) ) {
-                                od4Destination.send(cluon::serializeEnvelope(std::move(env)));
-                            }
-                            if ( (0 < mapOfEnvelopesToDrop.size()) && !mapOfEnvelopesToDrop.count(id) ) {
-                                od4Destination.send(cluon::serializeEnvelope(std::move(env)));
-                            }
-                        }
-                    }
-                }
-            );
+            {
+                cluon::UDPReceiver od4Source{"225.0.0." + commandlineArguments["cid-from"], 12175,
+                    createSourceDelegate([&od4Destination, &serializeRelayedEnvelope](cluon::data::Envelope &&env, uint32_t hops, uint32_t /*priorityClass*/, uint32_t /*channel*/){
+                        od4Destination.send(serializeRelayedEnvelope(std::move(env), hops));
+                    }, nullptr, 0)
+                };
 
-            using namespace std::literals::chrono_literals;
-            while (od4Source.isRunning()) {
-                std::this_thread::sleep_for(1s);
+                using namespace std::literals::chrono_literals;
+                while (od4Source.isRunning()) {
+                    std::this_thread::sleep_for(1s);
+                }
             }
+            dispatchers.clear();
         }
     }
     return retCode;
 }
-
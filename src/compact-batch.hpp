@@ -0,0 +1,343 @@
+/*
+ * Copyright (C) 2021  Christian Berger
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef COMPACT_BATCH_HPP
+#define COMPACT_BATCH_HPP
+
+#include "od4-frame.hpp"
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+/**
+ * A compact batch (extension type 3) holds consecutive serialized Envelopes
+ * without their OD4 headers and with their top-level fields recoded:
+ *
+ *    0x0D 0xA5 LEN TYPE=3 baseTime streams (dataType senderStamp)* count entry*
+ *    entry: stream timeStampFlags timeStampDelta* restLength rest
+ *
+ * where all fields are varints. dataType and senderStamp are replaced by an
+ * index into the list of streams of the batch, and the time stamps sent,
+ * received, and sampleTimeStamp (timeStampFlags bits 0..2) are encoded as
+ * ZigZag-encoded differences in microseconds to baseTime. rest holds all
+ * other top-level fields, e.g., the payload and the hop count, as they are.
+ *
+ * The restored Envelopes have the same fields and values, but the fields are
+ * not necessarily in the same order as before.
+ */
+namespace compact {
+
+constexpr uint32_t DATATYPE_FIELD{1};
+constexpr uint32_t SENT_FIELD{3};
+constexpr uint32_t RECEIVED_FIELD{4};
+constexpr uint32_t SAMPLETIMESTAMP_FIELD{5};
+constexpr uint32_t SENDERSTAMP_FIELD{6};
+constexpr std::size_t NUMBER_OF_TIMESTAMPS{3};
+
+inline uint64_t toZigZag64(int64_t v) noexcept {
+    return (static_cast<uint64_t>(v) << 1) ^ static_cast<uint64_t>(v >> 63);
+}
+
+inline int64_t fromZigZag64(uint64_t v) noexcept {
+    return static_cast<int64_t>((v >> 1) ^ (~(v & 1) + 1));
+}
+
+/**
+ * Top-level fields of a serialized Envelope that are recoded.
+ */
+struct Fields {
+    uint64_t dataType{0};    // As ZigZag-encoded varint.
+    uint64_t senderStamp{0};
+    uint8_t timeStampFlags{0};
+    int64_t timeStamps[NUMBER_OF_TIMESTAMPS]{0, 0, 0}; // In microseconds.
+    std::string rest{};
+};
+
+/**
+ * @return false if the given TimeStamp cannot be restored exactly from microseconds.
+ */
+inline bool parseTimeStamp(const char *data, std::size_t length, int64_t &microseconds) noexcept {
+    std::size_t pos{0};
+    uint64_t key{0};
+    uint64_t value{0};
+    int32_t seconds{0};
+    int32_t micros{0};
+    while (pos < length) {
+        if ( !od4::readVarInt(data, length, pos, key) || (0 != (key & 0x7)) || !od4::readVarInt(data, length, pos, value) ) {
+            return false;
+        }
+        if (1 == (key >> 3)) {
+            seconds = od4::fromZigZag32(value);
+        }
+        else if (2 == (key >> 3)) {
+            micros = od4::fromZigZag32(value);
+        }
+        else {
+            return false;
+        }
+    }
+    microseconds = static_cast<int64_t>(seconds) * 1000 * 1000 + micros;
+    return ( (pos == length) && (0 <= seconds) && (0 <= micros) && (1000 * 1000 > micros) );
+}
+
+/**
+ * @return false if the given serialized Envelope cannot be recoded.
+ */
+inline bool parse(const char *data, std::size_t length, Fields &fields) noexcept {
+    const std::size_t LENGTH{od4::HEADER_SIZE + od4::payloadLength(data, length)};
+    if ( (od4::HEADER_SIZE == LENGTH) || (length != LENGTH) ) {
+        return false;
+    }
+    fields.dataType = 0;
+    fields.senderStamp = 0;
+    fields.timeStampFlags = 0;
+    fields.rest.clear();
+    uint8_t seen{0};
+    std::size_t pos{od4::HEADER_SIZE};
+    uint64_t key{0};
+    uint64_t value{0};
+    while (pos < LENGTH) {
+        const std::size_t BEGIN{pos};
+        if (!od4::readVarInt(data, LENGTH, pos, key)) {
+            return false;
+        }
+        const uint32_t FIELD{static_cast<uint32_t>(key >> 3)};
+        const bool IS_TIMESTAMP{(SENT_FIELD <= FIELD) && (SAMPLETIMESTAMP_FIELD >= FIELD)};
+        const bool IS_RECODED{(DATATYPE_FIELD == FIELD) || (SENDERSTAMP_FIELD == FIELD) || IS_TIMESTAMP};
+        if (IS_RECODED) {
+            // Repeated fields or unexpected wire types are not recoded.
+            if ( (0 != (seen & (1 << FIELD))) || ((IS_TIMESTAMP ? 2u : 0u) != (key & 0x7)) ) {
+                return false;
+            }
+            seen |= static_cast<uint8_t>(1 << FIELD);
+        }
+        switch (key & 0x7) {
+            case 0: // VARINT
+                if (!od4::readVarInt(data, LENGTH, pos, value)) {
+                    return false;
+                }
+                break;
+            case 1: // EIGHT_BYTES
+                value = 8;
+                break;
+            case 2: // LENGTH_DELIMITED
+                if (!od4::readVarInt(data, LENGTH, pos, value)) {
+                    return false;
+                }
+                break;
+            case 5: // FOUR_BYTES
+                value = 4;
+                break;
+            default:
+                return false;
+        }
+        if ( (0 != (key & 0x7)) && (LENGTH - pos < value) ) {
+            return false;
+        }
+        if (DATATYPE_FIELD == FIELD) {
+            fields.dataType = value;
+        }
+        else if (SENDERSTAMP_FIELD == FIELD) {
+            fields.senderStamp = value;
+        }
+        else if (IS_TIMESTAMP) {
+            const std::size_t I{FIELD - SENT_FIELD};
+            if (!parseTimeStamp(data + pos, static_cast<std::size_t>(value), fields.timeStamps[I])) {
+                return false;
+            }
+            fields.timeStampFlags |= static_cast<uint8_t>(1 << I);
+        }
+        if (0 != (key & 0x7)) {
+            pos += static_cast<std::size_t>(value);
+        }
+        if (!IS_RECODED) {
+            fields.rest.append(data + BEGIN, pos - BEGIN);
+        }
+    }
+    return (pos == LENGTH);
+}
+
+/**
+ * This method replaces runs of at least two serialized Envelopes in the
+ * given frames by compact batches; other frames are kept in order.
+ */
+inline void pack(std::vector<od4::SharedFrame> &frames) noexcept {
+    std::vector<od4::SharedFrame> packed;
+    packed.reserve(frames.size());
+    std::unordered_map<uint64_t, uint32_t> streams;
+    std::string dictionary;
+    std::string entries;
+    std::vector<od4::SharedFrame> run;
+    Fields fields;
+    int64_t baseTime{0};
+
+    auto finishRun = [&]() {
+        std::size_t size{0};
+        for (const auto &f : run) {
+            size += f->size();
+        }
+        std::string frame{od4::beginExtension(od4::ExtensionType::COMPACT_BATCH)};
+        od4::writeVarInt(frame, toZigZag64(baseTime));
+        od4::writeVarInt(frame, streams.size());
+        frame.append(dictionary);
+        od4::writeVarInt(frame, run.size());
+        frame.append(entries);
+        if ( (1 < run.size()) && (frame.size() < size) && od4::finishExtension(frame) ) {
+            packed.emplace_back(std::make_shared<const std::string>(std::move(frame)));
+        }
+        else {
+            packed.insert(packed.end(), run.begin(), run.end());
+        }
+        run.clear();
+        streams.clear();
+        dictionary.clear();
+        entries.clear();
+    };
+
+    for (auto &f : frames) {
+        if (od4::isExtension(f->data(), f->size()) || !parse(f->data(), f->size(), fields)) {
+            if (!run.empty()) {
+                finishRun();
+            }
+            packed.emplace_back(std::move(f));
+            continue;
+        }
+        if (run.empty()) {
+            baseTime = 0;
+            for (std::size_t i{0}; i < NUMBER_OF_TIMESTAMPS; i++) {
+                if (0 != (fields.timeStampFlags & (1 << i))) {
+                    baseTime = fields.timeStamps[i];
+                    break;
+                }
+            }
+        }
+        const uint64_t STREAM{(fields.dataType << 32) | (fields.senderStamp & 0xffffffff)};
+        auto it = streams.find(STREAM);
+        if (streams.end() == it) {
+            it = streams.emplace(STREAM, static_cast<uint32_t>(streams.size())).first;
+            od4::writeVarInt(dictionary, fields.dataType);
+            od4::writeVarInt(dictionary, fields.senderStamp);
+        }
+        od4::writeVarInt(entries, it->second);
+        entries.push_back(static_cast<char>(fields.timeStampFlags));
+        for (std::size_t i{0}; i < NUMBER_OF_TIMESTAMPS; i++) {
+            if (0 != (fields.timeStampFlags & (1 << i))) {
+                od4::writeVarInt(entries, toZigZag64(fields.timeStamps[i] - baseTime));
+            }
+        }
+        od4::writeVarInt(entries, fields.rest.size());
+        entries.append(fields.rest);
+        run.emplace_back(std::move(f));
+    }
+    if (!run.empty()) {
+        finishRun();
+    }
+    frames.swap(packed);
+}
+
+inline void writeTimeStamp(std::string &out, uint32_t field, int64_t microseconds) noexcept {
+    std::string timeStamp;
+    od4::writeVarInt(timeStamp, (1 << 3) | 0);
+    od4::writeVarInt(timeStamp, toZigZag64(microseconds / (1000 * 1000)));
+    od4::writeVarInt(timeStamp, (2 << 3) | 0);
+    od4::writeVarInt(timeStamp, toZigZag64(microseconds % (1000 * 1000)));
+    od4::writeVarInt(out, (field << 3) | 2);
+    od4::writeVarInt(out, timeStamp.size());
+    out.append(timeStamp);
+}
+
+/**
+ * This method restores the serialized Envelopes of a compact batch.
+ *
+ * @param out Receives the concatenated serialized Envelopes.
+ * @return false if the given frame is malformed.
+ */
+inline bool unpack(const char *frame, std::size_t length, std::string &out) noexcept {
+    std::size_t pos{od4::EXTENSION_HEADER_SIZE};
+    uint64_t baseTime{0};
+    uint64_t numberOfStreams{0};
+    if ( !od4::isExtension(frame, length)
+         || (od4::ExtensionType::COMPACT_BATCH != od4::extensionType(frame))
+         || !od4::readVarInt(frame, length, pos, baseTime)
+         || !od4::readVarInt(frame, length, pos, numberOfStreams)
+         || ((length - pos) / 2 < numberOfStreams) ) {
+        return false;
+    }
+    std::vector<std::pair<uint64_t, uint64_t>> streams(static_cast<std::size_t>(numberOfStreams));
+    for (auto &s : streams) {
+        if ( !od4::readVarInt(frame, length, pos, s.first) || !od4::readVarInt(frame, length, pos, s.second) ) {
+            return false;
+        }
+    }
+    // Every Envelope takes at least its stream, flags, and length of the rest.
+    uint64_t count{0};
+    if ( !od4::readVarInt(frame, length, pos, count) || ((length - pos) / 3 < count) ) {
+        return false;
+    }
+    out.clear();
+    out.reserve(2 * length);
+    for (uint64_t i{0}; i < count; i++) {
+        uint64_t stream{0};
+        if ( !od4::readVarInt(frame, length, pos, stream) || (streams.size() <= stream) || (pos == length) ) {
+            return false;
+        }
+        const uint8_t FLAGS{static_cast<uint8_t>(frame[pos++])};
+        const std::size_t BEGIN{out.size()};
+        out.append(od4::HEADER_SIZE, '\0');
+        out[BEGIN] = static_cast<char>(od4::HEADER_BYTE0);
+        out[BEGIN + 1] = static_cast<char>(od4::HEADER_BYTE1);
+        od4::writeVarInt(out, (DATATYPE_FIELD << 3) | 0);
+        od4::writeVarInt(out, streams[static_cast<std::size_t>(stream)].first);
+        int64_t timeStamps[NUMBER_OF_TIMESTAMPS]{0, 0, 0};
+        for (std::size_t j{0}; j < NUMBER_OF_TIMESTAMPS; j++) {
+            uint64_t delta{0};
+            if ( (0 != (FLAGS & (1 << j))) && !od4::readVarInt(frame, length, pos, delta) ) {
+                return false;
+            }
+            timeStamps[j] = fromZigZag64(baseTime) + fromZigZag64(delta);
+        }
+        uint64_t restLength{0};
+        if ( !od4::readVarInt(frame, length, pos, restLength) || (length - pos < restLength) ) {
+            return false;
+        }
+        out.append(frame + pos, static_cast<std::size_t>(restLength));
+        pos += static_cast<std::size_t>(restLength);
+        for (std::size_t j{0}; j < NUMBER_OF_TIMESTAMPS; j++) {
+            if (0 != (FLAGS & (1 << j))) {
+                writeTimeStamp(out, static_cast<uint32_t>(SENT_FIELD + j), timeStamps[j]);
+            }
+        }
+        od4::writeVarInt(out, (SENDERSTAMP_FIELD << 3) | 0);
+        od4::writeVarInt(out, streams[static_cast<std::size_t>(stream)].second);
+        const std::size_t PAYLOAD_LENGTH{out.size() - BEGIN - od4::HEADER_SIZE};
+        if (0xffffff < PAYLOAD_LENGTH) {
+            return false;
+        }
+        out[BEGIN + 2] = static_cast<char>(PAYLOAD_LENGTH & 0xff);
+        out[BEGIN + 3] = static_cast<char>((PAYLOAD_LENGTH >> 8) & 0xff);
+        out[BEGIN + 4] = static_cast<char>((PAYLOAD_LENGTH >> 16) & 0xff);
+    }
+    return true;
+}
+
+} // namespace compact
+
+#endif
@@ -0,0 +1,177 @@
+/*
+ * Copyright (C) 2021  Christian Berger
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ENVELOPE_DEDUPLICATOR_HPP
+#define ENVELOPE_DEDUPLICATOR_HPP
+
+#include "od4-frame.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <unordered_set>
+#include <utility>
+
+/**
+ * This class detects Envelopes that arrive more than once within a given
+ * time window, e.g., when the same CID is fed by redundant publishers or
+ * network paths. An Envelope is identified by its dataType, senderStamp,
+ * sampleTimeStamp, and a hash of its payload, which are read from the
+ * serialized Envelope so that duplicates are never decoded, and by the
+ * channel it was received on, i.e., its source CID. Fingerprints are
+ * forgotten after the window has passed or when more than maxEntries are stored;
+ * the latter are counted as they may let duplicates pass.
+ */
+class EnvelopeDeduplicator {
+   private:
+    EnvelopeDeduplicator(const EnvelopeDeduplicator &) = delete;
+    EnvelopeDeduplicator(EnvelopeDeduplicator &&)      = delete;
+    EnvelopeDeduplicator &operator=(const EnvelopeDeduplicator &) = delete;
+    EnvelopeDeduplicator &operator=(EnvelopeDeduplicator &&) = delete;
+
+   public:
+    EnvelopeDeduplicator(int64_t windowInMicroseconds, std::size_t maxEntries = 65536) noexcept
+        : m_windowInMicroseconds{windowInMicroseconds}
+        , m_maxEntries{(0 < maxEntries) ? maxEntries : 1} {
+        m_fingerprints.reserve(std::min<std::size_t>(m_maxEntries, 65536));
+    }
+
+    /**
+     * @param data Serialized Envelope to check.
+     * @param length Length of the serialized Envelope.
+     * @param channel Channel the Envelope was received on.
+     * @param nowInMicroseconds Time when the Envelope was received.
+     * @return true if an identical Envelope was seen within the time window;
+     *         Envelopes that cannot be parsed are never duplicates.
+     */
+    bool isDuplicate(const char *data, std::size_t length, uint32_t channel, int64_t nowInMicroseconds) noexcept {
+        // Forget fingerprints that are outside the time window.
+        while (!m_fingerprintsByArrival.empty()
+               && ( (m_fingerprintsByArrival.front().first + m_windowInMicroseconds < nowInMicroseconds)
+                 || (m_maxEntries <= m_fingerprintsByArrival.size()) ) ) {
+            if (nowInMicroseconds <= m_fingerprintsByArrival.front().first + m_windowInMicroseconds) {
+                m_evictedWithinWindow++;
+            }
+            m_fingerprints.erase(m_fingerprintsByArrival.front().second);
+            m_fingerprintsByArrival.pop_front();
+        }
+
+        uint64_t fingerprint{0};
+        if (!fingerprintOf(data, length, channel, fingerprint)) {
+            return false;
+        }
+        bool retVal{0 < m_fingerprints.count(fingerprint)};
+        if (!retVal) {
+            m_fingerprints.insert(fingerprint);
+            m_fingerprintsByArrival.emplace_back(nowInMicroseconds, fingerprint);
+        }
+        return retVal;
+    }
+
+    /**
+     * @return Number of fingerprints that were forgotten within the time window because of maxEntries.
+     */
+    uint64_t evictedWithinWindow() const noexcept {
+        return m_evictedWithinWindow;
+    }
+
+   private:
+    static uint64_t fnv1a(uint64_t hash, const char *data, std::size_t length) noexcept {
+        constexpr uint64_t FNV_PRIME{0x100000001b3ULL};
+        for (std::size_t i{0}; i < length; i++) {
+            hash ^= static_cast<uint8_t>(data[i]);
+            hash *= FNV_PRIME;
+        }
+        return hash;
+    }
+
+    // Hashes the top-level fields dataType (1), serializedData (2), sampleTimeStamp (5),
+    // and senderStamp (6) as encoded; other fields like the hop count are ignored.
+    static bool fingerprintOf(const char *data, std::size_t length, uint32_t channel, uint64_t &fingerprint) noexcept {
+        constexpr uint64_t FNV_OFFSET_BASIS{0xcbf29ce484222325ULL};
+        const std::size_t LENGTH{od4::HEADER_SIZE + od4::payloadLength(data, length)};
+        if ( (od4::HEADER_SIZE == LENGTH) || (length < LENGTH) ) {
+            return false;
+        }
+        uint64_t dataType{0};
+        uint64_t senderStamp{0};
+        uint64_t sampleTimeStamp{FNV_OFFSET_BASIS};
+        uint64_t payload{FNV_OFFSET_BASIS};
+        std::size_t pos{od4::HEADER_SIZE};
+        uint64_t key{0};
+        uint64_t value{0};
+        while (pos < LENGTH) {
+            if (!od4::readVarInt(data, LENGTH, pos, key)) {
+                return false;
+            }
+            switch (key & 0x7) {
+                case 0: // VARINT
+                    if (!od4::readVarInt(data, LENGTH, pos, value)) {
+                        return false;
+                    }
+                    if (1 == (key >> 3)) {
+                        dataType = value;
+                    }
+                    else if (6 == (key >> 3)) {
+                        senderStamp = value;
+                    }
+                    continue;
+                case 1: // EIGHT_BYTES
+                    value = 8;
+                    break;
+                case 2: // LENGTH_DELIMITED
+                    if (!od4::readVarInt(data, LENGTH, pos, value)) {
+                        return false;
+                    }
+                    break;
+                case 5: // FOUR_BYTES
+                    value = 4;
+                    break;
+                default:
+                    return false;
+            }
+            if (LENGTH - pos < value) {
+                return false;
+            }
+            if ( (2 == (key >> 3)) && (2 == (key & 0x7)) ) {
+                payload = fnv1a(FNV_OFFSET_BASIS, data + pos, static_cast<std::size_t>(value));
+            }
+            else if ( (5 == (key >> 3)) && (2 == (key & 0x7)) ) {
+                sampleTimeStamp = fnv1a(FNV_OFFSET_BASIS, data + pos, static_cast<std::size_t>(value));
+            }
+            pos += static_cast<std::size_t>(value);
+        }
+
+        uint64_t hash{FNV_OFFSET_BASIS};
+        hash = fnv1a(hash, reinterpret_cast<const char*>(&channel), sizeof(channel));
+        hash = fnv1a(hash, reinterpret_cast<const char*>(&dataType), sizeof(dataType));
+        hash = fnv1a(hash, reinterpret_cast<const char*>(&senderStamp), sizeof(senderStamp));
+        hash = fnv1a(hash, reinterpret_cast<const char*>(&sampleTimeStamp), sizeof(sampleTimeStamp));
+        fingerprint = fnv1a(hash, reinterpret_cast<const char*>(&payload), sizeof(payload));
+        return true;
+    }
+
+   private:
+    int64_t m_windowInMicroseconds;
+    std::size_t m_maxEntries;
+    uint64_t m_evictedWithinWindow{0};
+    std::unordered_set<uint64_t> m_fingerprints{};
+    std::deque<std::pair<int64_t, uint64_t>> m_fingerprintsByArrival{};
+};
+
+#endif
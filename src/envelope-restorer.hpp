@@ -0,0 +1,130 @@
+/*
+ * Copyright (C) 2021  Christian Berger
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ENVELOPE_RESTORER_HPP
+#define ENVELOPE_RESTORER_HPP
+
+#include "batch-compressor.hpp"
+#include "compact-batch.hpp"
+#include "od4-frame.hpp"
+#include "stream-delta.hpp"
+
+#include <deque>
+#include <string>
+#include <utility>
+
+/**
+ * This class restores the serialized Envelopes from the byte stream of one
+ * TCP connection: Envelopes are passed on as they are, while compressed and
+ * compact batches as well as delta-encoded Envelopes are restored into
+ * buffers. Like the frames of the FrameDecoder, the restored Envelopes stay
+ * valid until the next call to restore. Channel frames assign the following
+ * Envelopes to a channel; without them, all Envelopes belong to channel 0.
+ * Other extension frames, e.g., subscriptions, are passed to onExtension.
+ */
+class EnvelopeRestorer {
+   private:
+    EnvelopeRestorer(const EnvelopeRestorer &) = delete;
+    EnvelopeRestorer(EnvelopeRestorer &&)      = delete;
+    EnvelopeRestorer &operator=(const EnvelopeRestorer &) = delete;
+    EnvelopeRestorer &operator=(EnvelopeRestorer &&) = delete;
+
+   public:
+    EnvelopeRestorer() = default;
+
+    /**
+     * This method calls delegate(uint32_t channel, const char *envelope, std::size_t length)
+     * for every complete and valid serialized Envelope in the given bytes.
+     *
+     * @return Number of bytes that were skipped.
+     */
+    template <typename Delegate>
+    std::size_t restore(const char *data, std::size_t length, Delegate &&delegate) {
+        return restore(data, length, std::forward<Delegate>(delegate), [](const char *, std::size_t) {});
+    }
+
+    /**
+     * This method additionally calls onExtension(const char *frame, std::size_t length)
+     * for every extension frame that does not carry Envelopes.
+     *
+     * @return Number of bytes that were skipped.
+     */
+    template <typename Delegate, typename ExtensionDelegate>
+    std::size_t restore(const char *data, std::size_t length, Delegate &&delegate, ExtensionDelegate &&onExtension) {
+        m_restored.clear();
+        auto forwardEnvelope = [this, &delegate](const char *frame, std::size_t len) {
+            od4::EnvelopeInfo info;
+            if (od4::peek(frame, len, info)) {
+                delegate(m_channel, frame, len);
+            }
+        };
+        auto forward = [this, &forwardEnvelope, &onExtension](const char *frame, std::size_t len) {
+            if (!od4::isExtension(frame, len)) {
+                forwardEnvelope(frame, len);
+            }
+            else if (od4::ExtensionType::CHANNEL == od4::extensionType(frame)) {
+                od4::channelOf(frame, len, m_channel);
+            }
+            else if (od4::ExtensionType::DELTA == od4::extensionType(frame)) {
+                m_restored.emplace_back();
+                if (m_deltaDecoder.decode(m_channel, frame, len, m_restored.back())) {
+                    forwardEnvelope(m_restored.back().data(), m_restored.back().size());
+                }
+            }
+            else if (od4::ExtensionType::COMPACT_BATCH == od4::extensionType(frame)) {
+                m_restored.emplace_back();
+                if (compact::unpack(frame, len, m_restored.back())) {
+                    std::size_t skipped{0};
+                    od4::cutFrames(m_restored.back().data(), m_restored.back().size(), skipped, forwardEnvelope);
+                }
+            }
+            else {
+                onExtension(frame, len);
+            }
+        };
+        return m_frameDecoder.decode(data, length, [this, &forward](const char *frame, std::size_t len) {
+            if (od4::isExtension(frame, len) && (od4::ExtensionType::COMPRESSED_BATCH == od4::extensionType(frame))) {
+                m_restored.emplace_back();
+                if (BatchCompressor::decompress(frame, len, m_restored.back())) {
+                    std::size_t skipped{0};
+                    od4::cutFrames(m_restored.back().data(), m_restored.back().size(), skipped, forward);
+                }
+            }
+            else {
+                forward(frame, len);
+            }
+        });
+    }
+
+    /**
+     * This method discards all state, e.g., after reconnecting.
+     */
+    void reset() noexcept {
+        m_frameDecoder.reset();
+        m_deltaDecoder.reset();
+        m_restored.clear();
+        m_channel = 0;
+    }
+
+   private:
+    od4::FrameDecoder m_frameDecoder{};
+    delta::DeltaDecoder m_deltaDecoder{};
+    std::deque<std::string> m_restored{};
+    uint32_t m_channel{0};
+};
+
+#endif
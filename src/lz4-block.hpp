@@ -0,0 +1,176 @@
+/*
+ * Copyright (C) 2021  Christian Berger
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LZ4_BLOCK_HPP
+#define LZ4_BLOCK_HPP
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+/**
+ * Self-contained compressor and decompressor for the LZ4 block format: a
+ * block is a sequence of (token, literals, 16-bit offset, match length)
+ * tuples, where the last sequence consists of literals only. The compressor
+ * is a greedy single-pass matcher over a hash table of 4-byte sequences that
+ * skips faster through incompressible data.
+ */
+namespace lz4 {
+
+constexpr std::size_t MIN_MATCH{4};
+constexpr std::size_t LAST_LITERALS{5};   // The last bytes of a block are always literals.
+constexpr std::size_t MATCH_FINDER_LIMIT{12}; // The last match must start before this many bytes from the end.
+constexpr std::size_t MAX_OFFSET{65535};
+constexpr uint32_t HASH_LOG{12};
+
+inline uint32_t read32(const char *p) noexcept {
+    uint32_t v;
+    std::memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+inline uint32_t hash(uint32_t sequence) noexcept {
+    return (sequence * 2654435761U) >> (32 - HASH_LOG);
+}
+
+inline void writeLength(std::string &out, std::size_t length) noexcept {
+    while (255 <= length) {
+        out.push_back(static_cast<char>(255));
+        length -= 255;
+    }
+    out.push_back(static_cast<char>(length));
+}
+
+inline void writeSequence(std::string &out, const char *literals, std::size_t literalLength, std::size_t offset, std::size_t matchLength) noexcept {
+    const std::size_t ML{(0 < matchLength) ? matchLength - MIN_MATCH : 0};
+    out.push_back(static_cast<char>(((std::min<std::size_t>(literalLength, 15)) << 4) | std::min<std::size_t>(ML, 15)));
+    if (15 <= literalLength) {
+        writeLength(out, literalLength - 15);
+    }
+    out.append(literals, literalLength);
+    if (0 < matchLength) {
+        out.push_back(static_cast<char>(offset & 0xff));
+        out.push_back(static_cast<char>((offset >> 8) & 0xff));
+        if (15 <= ML) {
+            writeLength(out, ML - 15);
+        }
+    }
+}
+
+/**
+ * This method appends the compressed block for the given data to out.
+ *
+ * @return Size of the compressed block.
+ */
+inline std::size_t compress(const char *data, std::size_t length, std::string &out) noexcept {
+    const std::size_t BEGIN{out.size()};
+    out.reserve(BEGIN + length + length / 255 + 16);
+    std::size_t anchor{0};
+    if (MATCH_FINDER_LIMIT < length) {
+        std::vector<uint32_t> table(static_cast<std::size_t>(1) << HASH_LOG, 0);
+        const std::size_t LIMIT{length - MATCH_FINDER_LIMIT};
+        const std::size_t MATCH_LIMIT{length - LAST_LITERALS};
+        std::size_t pos{0};
+        uint32_t misses{0};
+        while (pos < LIMIT) {
+            const uint32_t SEQUENCE{read32(data + pos)};
+            const uint32_t H{hash(SEQUENCE)};
+            std::size_t ref{table[H]};
+            table[H] = static_cast<uint32_t>(pos);
+            if ( (ref < pos) && (pos - ref <= MAX_OFFSET) && (read32(data + ref) == SEQUENCE) ) {
+                std::size_t matchLength{MIN_MATCH};
+                while ( (pos + matchLength < MATCH_LIMIT) && (data[ref + matchLength] == data[pos + matchLength]) ) {
+                    matchLength++;
+                }
+                // Extend the match backwards into the pending literals.
+                while ( (anchor < pos) && (0 < ref) && (data[pos - 1] == data[ref - 1]) ) {
+                    pos--;
+                    ref--;
+                    matchLength++;
+                }
+                writeSequence(out, data + anchor, pos - anchor, pos - ref, matchLength);
+                pos += matchLength;
+                anchor = pos;
+                misses = 0;
+            }
+            else {
+                // Skip faster through data that does not compress.
+                pos += 1 + (misses++ >> 6);
+            }
+        }
+    }
+    writeSequence(out, data + anchor, length - anchor, 0, 0);
+    return out.size() - BEGIN;
+}
+
+/**
+ * This method decompresses a block into exactly length bytes at out.
+ *
+ * @return false if the block is malformed or does not decompress to length bytes.
+ */
+inline bool decompress(const char *data, std::size_t size, char *out, std::size_t length) noexcept {
+    std::size_t in{0};
+    std::size_t pos{0};
+    auto readLength = [data, size, &in](std::size_t &l) {
+        uint8_t b{255};
+        while ( (255 == b) && (in < size) ) {
+            b = static_cast<uint8_t>(data[in++]);
+            l += b;
+        }
+        return (255 != b);
+    };
+    while (in < size) {
+        const uint8_t TOKEN{static_cast<uint8_t>(data[in++])};
+        std::size_t literalLength{static_cast<std::size_t>(TOKEN >> 4)};
+        if ( (15 == literalLength) && !readLength(literalLength) ) {
+            return false;
+        }
+        if ( (size - in < literalLength) || (length - pos < literalLength) ) {
+            return false;
+        }
+        std::memcpy(out + pos, data + in, literalLength);
+        in += literalLength;
+        pos += literalLength;
+        if (in == size) {
+            break; // The last sequence has no match.
+        }
+        if (size - in < 2) {
+            return false;
+        }
+        const std::size_t OFFSET{static_cast<std::size_t>(static_cast<uint8_t>(data[in])) | (static_cast<std::size_t>(static_cast<uint8_t>(data[in + 1])) << 8)};
+        in += 2;
+        std::size_t matchLength{static_cast<std::size_t>(TOKEN & 0x0f)};
+        if ( (15 == matchLength) && !readLength(matchLength) ) {
+            return false;
+        }
+        matchLength += MIN_MATCH;
+        if ( (0 == OFFSET) || (pos < OFFSET) || (length - pos < matchLength) ) {
+            return false;
+        }
+        // Matches may overlap with the bytes they produce.
+        for (std::size_t i{0}; i < matchLength; i++, pos++) {
+            out[pos] = out[pos - OFFSET];
+        }
+    }
+    return (pos == length);
+}
+
+} // namespace lz4
+
+#endif
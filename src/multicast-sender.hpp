@@ -0,0 +1,136 @@
+/*
+ * Copyright (C) 2021  Christian Berger
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MULTICAST_SENDER_HPP
+#define MULTICAST_SENDER_HPP
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+/**
+ * This class sends already serialized frames as UDP datagrams to a (multicast)
+ * address. Frames are queued without copying and sent with as few system calls
+ * as possible (sendmmsg on Linux) when flush is called; the queued bytes must
+ * stay valid until then.
+ */
+class MulticastSender {
+   private:
+    MulticastSender(const MulticastSender &) = delete;
+    MulticastSender(MulticastSender &&)      = delete;
+    MulticastSender &operator=(const MulticastSender &) = delete;
+    MulticastSender &operator=(MulticastSender &&) = delete;
+
+   public:
+    MulticastSender(const std::string &sendToAddress, uint16_t sendToPort) noexcept {
+        std::memset(&m_sendToAddress, 0, sizeof(m_sendToAddress));
+        m_sendToAddress.sin_family      = AF_INET;
+        m_sendToAddress.sin_addr.s_addr = ::inet_addr(sendToAddress.c_str());
+        m_sendToAddress.sin_port        = htons(sendToPort);
+        m_socket = ::socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    }
+
+    ~MulticastSender() noexcept {
+        if (!(m_socket < 0)) {
+            ::close(m_socket);
+        }
+        m_socket = -1;
+    }
+
+    bool isRunning() const noexcept {
+        return !(m_socket < 0);
+    }
+
+    /**
+     * This method queues a frame that is sent as one datagram with the next flush.
+     *
+     * @return false if the frame is too large for a UDP datagram.
+     */
+    bool queue(const char *data, std::size_t length) noexcept {
+        if ( (0 == length) || (MAX_LENGTH < length) ) {
+            return false;
+        }
+        struct iovec iov;
+        iov.iov_base = const_cast<char*>(data);
+        iov.iov_len = length;
+        m_frames.push_back(iov);
+        return true;
+    }
+
+    /**
+     * @return Number of datagrams that were sent.
+     */
+    std::size_t flush() noexcept {
+        std::size_t sent{0};
+        if (!(m_socket < 0)) {
+#ifdef __linux__
+            m_messages.resize(m_frames.size());
+            for (std::size_t i{0}; i < m_frames.size(); i++) {
+                std::memset(&m_messages[i], 0, sizeof(struct mmsghdr));
+                m_messages[i].msg_hdr.msg_name = &m_sendToAddress;
+                m_messages[i].msg_hdr.msg_namelen = sizeof(m_sendToAddress);
+                m_messages[i].msg_hdr.msg_iov = &m_frames[i];
+                m_messages[i].msg_hdr.msg_iovlen = 1;
+            }
+            std::size_t i{0};
+            while (i < m_messages.size()) {
+                const int RETVAL{::sendmmsg(m_socket, &m_messages[i], static_cast<unsigned int>(m_messages.size() - i), 0)};
+                if (0 < RETVAL) {
+                    i += static_cast<std::size_t>(RETVAL);
+                    sent += static_cast<std::size_t>(RETVAL);
+                }
+                else if ( (0 > RETVAL) && (EINTR == errno) ) {
+                    continue;
+                }
+                else {
+                    // Skip the datagram that could not be sent.
+                    i++;
+                }
+            }
+#else
+            for (const auto &iov : m_frames) {
+                if (0 < ::sendto(m_socket, iov.iov_base, iov.iov_len, 0, reinterpret_cast<const struct sockaddr *>(&m_sendToAddress), sizeof(m_sendToAddress))) {
+                    sent++;
+                }
+            }
+#endif
+        }
+        m_frames.clear();
+        return sent;
+    }
+
+   private:
+    // Maximum payload of an IPv4 UDP datagram.
+    static constexpr std::size_t MAX_LENGTH{65535 - 20 - 8};
+
+    int m_socket{-1};
+    struct sockaddr_in m_sendToAddress{};
+    std::vector<struct iovec> m_frames{};
+#ifdef __linux__
+    std::vector<struct mmsghdr> m_messages{};
+#endif
+};
+
+#endif
@@ -0,0 +1,380 @@
+/*
+ * Copyright (C) 2021  Christian Berger
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef OD4_FRAME_HPP
+#define OD4_FRAME_HPP
+
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <utility>
+
+/**
+ * Helpers to work directly on serialized Envelopes in the format
+ *
+ *    0x0D 0xA4 LEN0 LEN1 LEN2 Proto-encoded cluon::data::Envelope
+ *
+ * without decoding them into a cluon::data::Envelope.
+ */
+namespace od4 {
+
+constexpr uint8_t HEADER_BYTE0{0x0D};
+constexpr uint8_t HEADER_BYTE1{0xA4};
+constexpr std::size_t HEADER_SIZE{5};
+
+// Serialized Envelope that is shared by several queues without copying it.
+using SharedFrame = std::shared_ptr<const std::string>;
+
+// Proto field identifier that is not used by cluon::data::Envelope to carry
+// the number of relays an Envelope has passed; decoders ignore unknown fields.
+constexpr uint32_t HOP_FIELD_IDENTIFIER{2047};
+
+inline bool readVarInt(const char *data, std::size_t length, std::size_t &pos, uint64_t &v) noexcept {
+    v = 0;
+    for (uint8_t shift{0}; (pos < length) && (shift < 64); shift += 7) {
+        const uint8_t b{static_cast<uint8_t>(data[pos++])};
+        v |= static_cast<uint64_t>(b & 0x7f) << shift;
+        if (0 == (b & 0x80)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+inline void writeVarInt(std::string &out, uint64_t v) noexcept {
+    while (0x7f < v) {
+        out.push_back(static_cast<char>((v & 0x7f) | 0x80));
+        v >>= 7;
+    }
+    out.push_back(static_cast<char>(v));
+}
+
+/**
+ * @return Length of the Proto-encoded payload following the header or 0 if
+ *         the given bytes do not start with an OD4 header.
+ */
+inline uint32_t payloadLength(const char *data, std::size_t length) noexcept {
+    uint32_t retVal{0};
+    if ( (HEADER_SIZE <= length)
+         && (HEADER_BYTE0 == static_cast<uint8_t>(data[0]))
+         && (HEADER_BYTE1 == static_cast<uint8_t>(data[1])) ) {
+        retVal = static_cast<uint32_t>(static_cast<uint8_t>(data[2]))
+               | (static_cast<uint32_t>(static_cast<uint8_t>(data[3])) << 8)
+               | (static_cast<uint32_t>(static_cast<uint8_t>(data[4])) << 16);
+    }
+    return retVal;
+}
+
+inline void setPayloadLength(std::string &frame, uint32_t length) noexcept {
+    frame[2] = static_cast<char>(length & 0xff);
+    frame[3] = static_cast<char>((length >> 8) & 0xff);
+    frame[4] = static_cast<char>((length >> 16) & 0xff);
+}
+
+/**
+ * Fields of a serialized Envelope that are needed to route it.
+ */
+struct EnvelopeInfo {
+    int32_t dataType{0};
+    uint32_t senderStamp{0};
+    uint32_t hops{0};
+};
+
+inline int32_t fromZigZag32(uint64_t v) noexcept {
+    return static_cast<int32_t>((v >> 1) ^ (~(v & 1) + 1));
+}
+
+/**
+ * This method scans the top-level Proto fields of a serialized Envelope
+ * without decoding its payload or time stamps.
+ *
+ * @return true if the given bytes contain a complete serialized Envelope.
+ */
+inline bool peek(const char *data, std::size_t length, EnvelopeInfo &info) noexcept {
+    const uint32_t PAYLOAD_LENGTH{payloadLength(data, length)};
+    const std::size_t LENGTH{HEADER_SIZE + PAYLOAD_LENGTH};
+    if ( (0 == PAYLOAD_LENGTH) || (length < LENGTH) ) {
+        return false;
+    }
+    info = EnvelopeInfo();
+    std::size_t pos{HEADER_SIZE};
+    uint64_t key{0};
+    uint64_t value{0};
+    while ( (pos < LENGTH) && readVarInt(data, LENGTH, pos, key) ) {
+        switch (key & 0x7) {
+            case 0: // VARINT
+                if (!readVarInt(data, LENGTH, pos, value)) {
+                    return false;
+                }
+                if (1 == (key >> 3)) {
+                    info.dataType = fromZigZag32(value);
+                }
+                else if (6 == (key >> 3)) {
+                    info.senderStamp = static_cast<uint32_t>(value);
+                }
+                else if (HOP_FIELD_IDENTIFIER == (key >> 3)) {
+                    info.hops = static_cast<uint32_t>(value);
+                }
+                break;
+            case 1: // EIGHT_BYTES
+                value = 8;
+                break;
+            case 2: // LENGTH_DELIMITED
+                if (!readVarInt(data, LENGTH, pos, value)) {
+                    return false;
+                }
+                break;
+            case 5: // FOUR_BYTES
+                value = 4;
+                break;
+            default:
+                return false;
+        }
+        if (0 != (key & 0x7)) {
+            // A field must not reach beyond the Envelope; this also keeps pos from wrapping.
+            if (LENGTH - pos < value) {
+                return false;
+            }
+            pos += static_cast<std::size_t>(value);
+        }
+    }
+    return (pos == LENGTH);
+}
+
+/**
+ * @return Number of relays the given serialized Envelope has passed already.
+ */
+inline uint32_t hopCount(const char *data, std::size_t length) noexcept {
+    EnvelopeInfo info;
+    return peek(data, length, info) ? info.hops : 0;
+}
+
+inline uint32_t hopCount(const std::string &frame) noexcept {
+    return hopCount(frame.data(), frame.size());
+}
+
+/**
+ * This method appends the hop count to a serialized Envelope that does not
+ * carry a hop count yet, e.g., one freshly created by cluon::serializeEnvelope.
+ */
+inline std::string withHopCount(std::string &&frame, uint32_t hops) noexcept {
+    if (HEADER_SIZE <= frame.size()) {
+        writeVarInt(frame, (static_cast<uint64_t>(HOP_FIELD_IDENTIFIER) << 3) | 0 /* VARINT */);
+        writeVarInt(frame, hops);
+        setPayloadLength(frame, static_cast<uint32_t>(frame.size() - HEADER_SIZE));
+    }
+    return std::move(frame);
+}
+
+/**
+ * Frames in the same stream that carry data of the relay itself instead of
+ * an Envelope, e.g., a compressed batch of frames, have the format
+ *
+ *    0x0D 0xA5 LEN0 LEN1 LEN2 TYPE payload
+ *
+ * where LEN covers TYPE and payload.
+ */
+constexpr uint8_t EXTENSION_BYTE1{0xA5};
+constexpr std::size_t EXTENSION_HEADER_SIZE{HEADER_SIZE + 1};
+
+enum class ExtensionType : uint8_t {
+    COMPRESSED_BATCH = 1, // Varint uncompressed size, LZ4 block of frames.
+    DELTA = 2,            // Envelope encoded as difference to the previous one of its stream.
+    COMPACT_BATCH = 3,    // Envelopes with recoded top-level fields.
+    CHANNEL = 4,          // Varint channel of the following frames.
+    SUBSCRIPTION = 5,     // Envelopes that a client wants to receive.
+    SEQUENCE = 6,         // Varint sequence of the following batch.
+    ACK = 7,              // Varint session and sequence received by a client.
+    RESUME = 8,           // Resume request of a client or the server's answer.
+};
+
+inline bool isExtension(const char *data, std::size_t length) noexcept {
+    return ( (EXTENSION_HEADER_SIZE <= length)
+             && (HEADER_BYTE0 == static_cast<uint8_t>(data[0]))
+             && (EXTENSION_BYTE1 == static_cast<uint8_t>(data[1])) );
+}
+
+inline ExtensionType extensionType(const char *data) noexcept {
+    return static_cast<ExtensionType>(data[HEADER_SIZE]);
+}
+
+/**
+ * @return Header of an extension frame of the given type; its length is set
+ *         by finishExtension once the payload is appended.
+ */
+inline std::string beginExtension(ExtensionType type) noexcept {
+    std::string frame(EXTENSION_HEADER_SIZE, '\0');
+    frame[0] = static_cast<char>(HEADER_BYTE0);
+    frame[1] = static_cast<char>(EXTENSION_BYTE1);
+    frame[HEADER_SIZE] = static_cast<char>(type);
+    return frame;
+}
+
+/**
+ * @return false if the payload does not fit into the 24-bit length.
+ */
+inline bool finishExtension(std::string &frame) noexcept {
+    const std::size_t LENGTH{frame.size() - HEADER_SIZE};
+    if (0xffffff < LENGTH) {
+        return false;
+    }
+    setPayloadLength(frame, static_cast<uint32_t>(LENGTH));
+    return true;
+}
+
+/**
+ * @return Frame that assigns the following frames in the stream to the given channel.
+ */
+inline std::string channelFrame(uint32_t channel) noexcept {
+    std::string frame{beginExtension(ExtensionType::CHANNEL)};
+    writeVarInt(frame, channel);
+    finishExtension(frame);
+    return frame;
+}
+
+/**
+ * @return false if the given frame is not a valid channel frame.
+ */
+inline bool channelOf(const char *data, std::size_t length, uint32_t &channel) noexcept {
+    std::size_t pos{EXTENSION_HEADER_SIZE};
+    uint64_t value{0};
+    if ( !isExtension(data, length) || (ExtensionType::CHANNEL != extensionType(data))
+         || !readVarInt(data, length, pos, value) || (0xffffffff < value) ) {
+        return false;
+    }
+    channel = static_cast<uint32_t>(value);
+    return true;
+}
+
+/**
+ * @return Length of the frame (Envelope or extension) including its header
+ *         or 0 if the given bytes do not start with a frame header.
+ */
+inline std::size_t frameLength(const char *data, std::size_t length) noexcept {
+    std::size_t retVal{0};
+    if ( (HEADER_SIZE <= length)
+         && (HEADER_BYTE0 == static_cast<uint8_t>(data[0]))
+         && ( (HEADER_BYTE1 == static_cast<uint8_t>(data[1])) || (EXTENSION_BYTE1 == static_cast<uint8_t>(data[1])) ) ) {
+        retVal = HEADER_SIZE + ( static_cast<uint32_t>(static_cast<uint8_t>(data[2]))
+                               | (static_cast<uint32_t>(static_cast<uint8_t>(data[3])) << 8)
+                               | (static_cast<uint32_t>(static_cast<uint8_t>(data[4])) << 16) );
+    }
+    return retVal;
+}
+
+/**
+ * This method calls delegate(const char *frame, std::size_t length) for every
+ * complete frame in the given bytes; bytes that do not belong to a frame are
+ * skipped up to the next header.
+ *
+ * @return Number of bytes consumed; the remaining bytes are an incomplete frame.
+ */
+template <typename Delegate>
+std::size_t cutFrames(const char *data, std::size_t length, std::size_t &skipped, Delegate &delegate) {
+    std::size_t pos{0};
+    while (pos < length) {
+        if ( (HEADER_BYTE0 != static_cast<uint8_t>(data[pos]))
+             || ( (pos + 1 < length) && (HEADER_BYTE1 != static_cast<uint8_t>(data[pos + 1])) && (EXTENSION_BYTE1 != static_cast<uint8_t>(data[pos + 1])) ) ) {
+            // Resynchronize at the next possible header.
+            const void *next{std::memchr(data + pos + 1, HEADER_BYTE0, length - pos - 1)};
+            const std::size_t NEXT{(nullptr != next) ? static_cast<std::size_t>(static_cast<const char*>(next) - data) : length};
+            skipped += NEXT - pos;
+            pos = NEXT;
+            continue;
+        }
+        if (length < pos + HEADER_SIZE) {
+            break;
+        }
+        const std::size_t FRAME_LENGTH{frameLength(data + pos, length - pos)};
+        if (length < pos + FRAME_LENGTH) {
+            break;
+        }
+        delegate(data + pos, FRAME_LENGTH);
+        pos += FRAME_LENGTH;
+    }
+    return pos;
+}
+
+/**
+ * This class cuts complete frames from a byte stream, e.g., from a TCP
+ * connection, where a frame may be split across several chunks. Bytes of an
+ * incomplete frame are kept until the next chunk arrives; bytes that do not
+ * belong to a frame are skipped up to the next header.
+ */
+class FrameDecoder {
+   private:
+    FrameDecoder(const FrameDecoder &) = delete;
+    FrameDecoder(FrameDecoder &&)      = delete;
+    FrameDecoder &operator=(const FrameDecoder &) = delete;
+    FrameDecoder &operator=(FrameDecoder &&) = delete;
+
+   public:
+    FrameDecoder() = default;
+
+    /**
+     * This method calls delegate(const char *frame, std::size_t length) for
+     * every complete frame including its header. The frames point either into
+     * the given data or into the internal buffer and stay valid until the next
+     * call to decode.
+     *
+     * @return Number of bytes that were skipped.
+     */
+    template <typename Delegate>
+    std::size_t decode(const char *data, std::size_t length, Delegate &&delegate) {
+        // Drop the frames that were handed out by the previous call.
+        if (m_consumed == m_buffer.size()) {
+            m_buffer.clear();
+        }
+        else if (0 < m_consumed) {
+            m_buffer.erase(0, m_consumed);
+        }
+        m_consumed = 0;
+
+        std::size_t skipped{0};
+        if (m_buffer.empty()) {
+            // Fast path: only keep the bytes of the last, incomplete frame.
+            const std::size_t CONSUMED{cutFrames(data, length, skipped, delegate)};
+            m_buffer.assign(data + CONSUMED, length - CONSUMED);
+        }
+        else {
+            m_buffer.append(data, length);
+            m_consumed = cutFrames(m_buffer.data(), m_buffer.size(), skipped, delegate);
+        }
+        return skipped;
+    }
+
+    /**
+     * @return Number of bytes waiting for the rest of their frame.
+     */
+    std::size_t pending() const noexcept {
+        return m_buffer.size() - m_consumed;
+    }
+
+    void reset() noexcept {
+        m_buffer.clear();
+        m_consumed = 0;
+    }
+
+   private:
+    std::string m_buffer{};
+    std::size_t m_consumed{0};
+};
+
+} // namespace od4
+
+#endif
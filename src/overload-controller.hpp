@@ -0,0 +1,148 @@
+/*
+ * Copyright (C) 2021  Christian Berger
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef OVERLOAD_CONTROLLER_HPP
+#define OVERLOAD_CONTROLLER_HPP
+
+#include <algorithm>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+/**
+ * This class sheds load when the relay cannot keep up with its source. It
+ * watches the processing lag (time between receiving an Envelope from the
+ * socket and processing it) and the backlog of pending Envelopes. When either
+ * exceeds its limit, one more stage from the configured priority list (lowest
+ * priority first) is activated; a stage either downsamples an Envelope ID
+ * further or drops it entirely. Stages are deactivated one by one again once
+ * lag and backlog stay below half of their limits.
+ */
+class OverloadController {
+   private:
+    OverloadController(const OverloadController &) = delete;
+    OverloadController(OverloadController &&)      = delete;
+    OverloadController &operator=(const OverloadController &) = delete;
+    OverloadController &operator=(OverloadController &&) = delete;
+
+   public:
+    struct Stage {
+        int32_t dataType{0};
+        uint32_t downsampling{0}; // 0: drop all Envelopes of dataType.
+    };
+
+   public:
+    OverloadController(std::vector<Stage> &&stages, int64_t maxLagInMicroseconds, std::size_t maxBacklog) noexcept
+        : m_stages{std::move(stages)}
+        , m_counters(m_stages.size(), 0)
+        , m_maxLagInMicroseconds{maxLagInMicroseconds}
+        , m_maxBacklog{maxBacklog} {}
+
+    /**
+     * @param lagInMicroseconds Processing lag of the current Envelope.
+     * @param queueDepth Number of Envelopes waiting in queues known to the caller.
+     * @param nowInMicroseconds Current time.
+     * @return true if the number of active stages has changed.
+     */
+    bool update(int64_t lagInMicroseconds, std::size_t queueDepth, int64_t nowInMicroseconds) noexcept {
+        // Smooth the lag and estimate the arrival rate to derive the backlog (Little's law).
+        m_lagInMicroseconds += (std::max<int64_t>(lagInMicroseconds, 0) - m_lagInMicroseconds) / 8;
+        m_arrivals++;
+        m_rateWindowBegin = (0 == m_rateWindowBegin) ? nowInMicroseconds : m_rateWindowBegin;
+        if (RATE_WINDOW_IN_MICROSECONDS <= (nowInMicroseconds - m_rateWindowBegin)) {
+            const double RATE{static_cast<double>(m_arrivals) * 1000.0 * 1000.0 / static_cast<double>(nowInMicroseconds - m_rateWindowBegin)};
+            m_ratePerSecond = (0.0 < m_ratePerSecond) ? (0.75 * m_ratePerSecond + 0.25 * RATE) : RATE;
+            m_arrivals = 0;
+            m_rateWindowBegin = nowInMicroseconds;
+        }
+        m_backlog = std::max(queueDepth, static_cast<std::size_t>(m_ratePerSecond * static_cast<double>(m_lagInMicroseconds) / (1000.0 * 1000.0)));
+
+        const bool OVERLOADED{(m_maxLagInMicroseconds < m_lagInMicroseconds) || (m_maxBacklog < m_backlog)};
+        const bool RELAXED{(m_lagInMicroseconds < m_maxLagInMicroseconds / 2) && (m_backlog < m_maxBacklog / 2)};
+        m_relaxedSince = (RELAXED && (0 == m_relaxedSince)) ? nowInMicroseconds : (RELAXED ? m_relaxedSince : 0);
+
+        bool retVal{false};
+        if ( OVERLOADED && (m_level < m_stages.size())
+             && (ESCALATION_INTERVAL_IN_MICROSECONDS <= (nowInMicroseconds - m_lastChange)) ) {
+            m_counters[m_level] = 0;
+            m_level++;
+            m_lastChange = nowInMicroseconds;
+            retVal = true;
+        }
+        else if ( RELAXED && (0 < m_level)
+                  && (RECOVERY_INTERVAL_IN_MICROSECONDS <= (nowInMicroseconds - m_relaxedSince))
+                  && (RECOVERY_INTERVAL_IN_MICROSECONDS <= (nowInMicroseconds - m_lastChange)) ) {
+            m_level--;
+            m_lastChange = nowInMicroseconds;
+            m_relaxedSince = nowInMicroseconds;
+            retVal = true;
+        }
+        return retVal;
+    }
+
+    /**
+     * @return true if an Envelope of the given dataType is to be dropped.
+     */
+    bool isToBeShed(int32_t dataType) noexcept {
+        // The highest active stage for dataType decides.
+        for (std::size_t i{m_level}; 0 < i; i--) {
+            const Stage &stage{m_stages[i - 1]};
+            if (stage.dataType == dataType) {
+                if (0 == stage.downsampling) {
+                    return true;
+                }
+                m_counters[i - 1] = (m_counters[i - 1] + 1) % stage.downsampling;
+                return (0 != m_counters[i - 1]);
+            }
+        }
+        return false;
+    }
+
+    std::size_t level() const noexcept {
+        return m_level;
+    }
+
+    int64_t lagInMicroseconds() const noexcept {
+        return m_lagInMicroseconds;
+    }
+
+    std::size_t backlog() const noexcept {
+        return m_backlog;
+    }
+
+   private:
+    static constexpr int64_t RATE_WINDOW_IN_MICROSECONDS{100 * 1000};
+    static constexpr int64_t ESCALATION_INTERVAL_IN_MICROSECONDS{100 * 1000};
+    static constexpr int64_t RECOVERY_INTERVAL_IN_MICROSECONDS{1000 * 1000};
+
+    std::vector<Stage> m_stages;
+    std::vector<uint32_t> m_counters;
+    int64_t m_maxLagInMicroseconds;
+    std::size_t m_maxBacklog;
+
+    std::size_t m_level{0};
+    int64_t m_lastChange{0};
+    int64_t m_relaxedSince{0};
+
+    int64_t m_lagInMicroseconds{0};
+    uint32_t m_arrivals{0};
+    int64_t m_rateWindowBegin{0};
+    double m_ratePerSecond{0.0};
+    std::size_t m_backlog{0};
+};
+
+#endif
@@ -0,0 +1,180 @@
+/*
+ * Copyright (C) 2021  Christian Berger
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PRIORITY_DISPATCHER_HPP
+#define PRIORITY_DISPATCHER_HPP
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+/**
+ * This class keeps one queue per priority class (0 is the highest priority)
+ * and calls the given delegate from its own thread for every entry. Without
+ * weights, the queues are served strictly by priority; with weights, queue i
+ * is served up to weights[i] entries in a row before the next non-empty queue
+ * gets its turn. The queues share a capacity of maxEntriesPerClass entries per
+ * class: When it is reached, the oldest entry of the lowest priority class is
+ * dropped unless the new entry has an even lower priority, in which case the
+ * new entry is dropped. Entries of class 0 are never dropped; instead, push
+ * waits until there is room. Entries still queued on destruction are dispatched.
+ */
+template <typename T>
+class PriorityDispatcher {
+   private:
+    PriorityDispatcher(const PriorityDispatcher &) = delete;
+    PriorityDispatcher(PriorityDispatcher &&)      = delete;
+    PriorityDispatcher &operator=(const PriorityDispatcher &) = delete;
+    PriorityDispatcher &operator=(PriorityDispatcher &&) = delete;
+
+   public:
+    PriorityDispatcher(uint32_t numberOfClasses, std::vector<uint32_t> weights, std::size_t maxEntriesPerClass, std::function<void(T &&)> delegate) noexcept
+        : m_queues((0 < numberOfClasses) ? numberOfClasses : 1)
+        , m_weights(std::move(weights))
+        , m_capacity{((0 < maxEntriesPerClass) ? maxEntriesPerClass : 1) * m_queues.size()}
+        , m_delegate(std::move(delegate)) {
+        m_weights.resize(m_queues.size(), m_weights.empty() ? 0 : 1);
+        for (auto &w : m_weights) {
+            m_isWeighted |= (0 < w);
+            w = (0 < w) ? w : 1;
+        }
+        m_credit = m_weights[0];
+        m_dispatcherThreadRunning.store(true);
+        m_dispatcherThread = std::thread(&PriorityDispatcher::dispatch, this);
+    }
+
+    ~PriorityDispatcher() {
+        {
+            std::lock_guard<std::mutex> lck(m_queuesMutex);
+            m_dispatcherThreadRunning.store(false);
+        }
+        m_queuesCondition.notify_all();
+        m_spaceCondition.notify_all();
+        try {
+            if (m_dispatcherThread.joinable()) {
+                m_dispatcherThread.join();
+            }
+        } catch (...) {}
+    }
+
+   public:
+    /**
+     * @return false if an entry, possibly the given one, had to be dropped.
+     */
+    bool push(uint32_t priorityClass, T &&entry) noexcept {
+        bool retVal{true};
+        {
+            std::unique_lock<std::mutex> lck(m_queuesMutex);
+            const std::size_t CLASS{(priorityClass < m_queues.size()) ? priorityClass : m_queues.size() - 1};
+            if (m_capacity <= m_size.load()) {
+                std::size_t lowest{m_queues.size() - 1};
+                while (m_queues[lowest].empty()) {
+                    lowest--;
+                }
+                if (lowest < CLASS) {
+                    return false;
+                }
+                if (0 < lowest) {
+                    m_queues[lowest].pop_front();
+                    m_size--;
+                    retVal = false;
+                }
+                else {
+                    // All queued entries are of class 0 like the new one.
+                    m_spaceCondition.wait(lck, [this]{ return (!m_dispatcherThreadRunning.load() || (m_size.load() < m_capacity)); });
+                }
+            }
+            m_queues[CLASS].emplace_back(std::move(entry));
+            m_size++;
+        }
+        m_queuesCondition.notify_one();
+        return retVal;
+    }
+
+    /**
+     * @return Number of entries waiting in all queues.
+     */
+    std::size_t size() const noexcept {
+        return m_size.load();
+    }
+
+   private:
+    // Must be called with m_queuesMutex locked and at least one entry available.
+    std::size_t nextClass() noexcept {
+        if (!m_isWeighted) {
+            std::size_t i{0};
+            while (m_queues[i].empty()) {
+                i++;
+            }
+            return i;
+        }
+        while ( (0 == m_credit) || m_queues[m_current].empty() ) {
+            m_current = (m_current + 1) % m_queues.size();
+            m_credit = m_weights[m_current];
+        }
+        m_credit--;
+        return m_current;
+    }
+
+    void dispatch() noexcept {
+        while (true) {
+            T entry;
+            {
+                std::unique_lock<std::mutex> lck(m_queuesMutex);
+                m_queuesCondition.wait(lck, [this]{ return (!m_dispatcherThreadRunning.load() || (0 < m_size.load())); });
+                // The remaining entries are dispatched before stopping.
+                if (0 == m_size.load()) {
+                    break;
+                }
+                auto &queue = m_queues[nextClass()];
+                entry = std::move(queue.front());
+                queue.pop_front();
+                m_size--;
+            }
+            m_spaceCondition.notify_one();
+            if (nullptr != m_delegate) {
+                m_delegate(std::move(entry));
+            }
+        }
+    }
+
+   private:
+    std::vector<std::deque<T>> m_queues;
+    std::vector<uint32_t> m_weights;
+    std::size_t m_capacity;
+    std::function<void(T &&)> m_delegate;
+
+    bool m_isWeighted{false};
+    std::size_t m_current{0};
+    uint32_t m_credit{0};
+    std::atomic<std::size_t> m_size{0};
+
+    std::mutex m_queuesMutex{};
+    std::condition_variable m_queuesCondition{};
+    std::condition_variable m_spaceCondition{};
+    std::atomic<bool> m_dispatcherThreadRunning{false};
+    std::thread m_dispatcherThread{};
+};
+
+#endif
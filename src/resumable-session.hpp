@@ -0,0 +1,266 @@
+/*
+ * Copyright (C) 2021  Christian Berger
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef RESUMABLE_SESSION_HPP
+#define RESUMABLE_SESSION_HPP
+
+#include "od4-frame.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+/**
+ * A TCP client can resume its session after the connection was lost without
+ * losing the batches that were sent in between:
+ *
+ *    0x0D 0xA5 LEN TYPE=6 sequence           server: sequence of the following batch
+ *    0x0D 0xA5 LEN TYPE=7 session sequence   client: all batches up to sequence were received
+ *    0x0D 0xA5 LEN TYPE=8 session            client: resume session after reconnecting
+ *    0x0D 0xA5 LEN TYPE=8 isComplete         server: the batches after the last acknowledged
+ *                                            one follow (1) or are lost (0)
+ *
+ * where all fields are varints and session is chosen by the client. The
+ * server keeps the most recent batches in a ReplayBuffer and replays them
+ * from the sequence that was acknowledged last.
+ */
+namespace session {
+
+inline std::string sequenceFrame(uint64_t sequence) noexcept {
+    std::string frame{od4::beginExtension(od4::ExtensionType::SEQUENCE)};
+    od4::writeVarInt(frame, sequence);
+    od4::finishExtension(frame);
+    return frame;
+}
+
+inline std::string ackFrame(uint64_t session, uint64_t sequence) noexcept {
+    std::string frame{od4::beginExtension(od4::ExtensionType::ACK)};
+    od4::writeVarInt(frame, session);
+    od4::writeVarInt(frame, sequence);
+    od4::finishExtension(frame);
+    return frame;
+}
+
+inline std::string resumeFrame(uint64_t sessionOrIsComplete) noexcept {
+    std::string frame{od4::beginExtension(od4::ExtensionType::RESUME)};
+    od4::writeVarInt(frame, sessionOrIsComplete);
+    od4::finishExtension(frame);
+    return frame;
+}
+
+/**
+ * @return false if the given frame is not an extension frame of the given
+ *         type with the given number of varints.
+ */
+inline bool parse(const char *data, std::size_t length, od4::ExtensionType type, uint64_t *values, std::size_t count) noexcept {
+    std::size_t pos{od4::EXTENSION_HEADER_SIZE};
+    if (!od4::isExtension(data, length) || (type != od4::extensionType(data))) {
+        return false;
+    }
+    for (std::size_t i{0}; i < count; i++) {
+        if (!od4::readVarInt(data, length, pos, values[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * This class keeps the most recent batches up to a total size together with
+ * their sequence numbers, and the sequence that every session acknowledged
+ * last. The batches are kept as relayed, i.e., before they are encoded for
+ * the clients, so that they can be replayed to any client.
+ *
+ * This class is not thread-safe.
+ */
+class ReplayBuffer {
+   private:
+    ReplayBuffer(const ReplayBuffer &) = delete;
+    ReplayBuffer(ReplayBuffer &&)      = delete;
+    ReplayBuffer &operator=(const ReplayBuffer &) = delete;
+    ReplayBuffer &operator=(ReplayBuffer &&) = delete;
+
+   private:
+    struct Batch {
+        uint64_t sequence{0};
+        std::size_t size{0};
+        std::vector<od4::SharedFrame> frames{};
+    };
+
+   public:
+    /**
+     * @param maxSize Maximum number of bytes of all batches that are kept.
+     */
+    explicit ReplayBuffer(std::size_t maxSize) noexcept
+        : m_maxSize{maxSize} {}
+
+    /**
+     * @return Sequence of the given batch that was appended.
+     */
+    uint64_t append(const std::vector<od4::SharedFrame> &frames) noexcept {
+        Batch b;
+        b.sequence = ++m_sequence;
+        for (const auto &f : frames) {
+            b.size += f->size();
+        }
+        b.frames = frames;
+        m_size += b.size;
+        m_batches.emplace_back(std::move(b));
+        while ( (m_maxSize < m_size) && (1 < m_batches.size()) ) {
+            m_size -= m_batches.front().size;
+            m_batches.pop_front();
+        }
+        return m_sequence;
+    }
+
+    void acknowledge(uint64_t session, uint64_t sequence) noexcept {
+        if ( (m_acknowledged.end() == m_acknowledged.find(session)) && (MAX_SESSIONS <= m_acknowledged.size()) ) {
+            // Forget the session that is the longest behind.
+            auto oldest = std::min_element(m_acknowledged.begin(), m_acknowledged.end(), [](const std::pair<const uint64_t, uint64_t> &a, const std::pair<const uint64_t, uint64_t> &b) {
+                return a.second < b.second;
+            });
+            m_acknowledged.erase(oldest);
+        }
+        uint64_t &acknowledged = m_acknowledged[session];
+        acknowledged = std::max(acknowledged, std::min(sequence, m_sequence));
+    }
+
+    /**
+     * This method calls delegate(uint64_t sequence, const std::vector<od4::SharedFrame> &frames)
+     * for every batch after the one that the given session acknowledged last.
+     *
+     * @return false if the session is unknown or some of its batches are not kept anymore.
+     */
+    template <typename Delegate>
+    bool replay(uint64_t session, Delegate &&delegate) const {
+        auto it = m_acknowledged.find(session);
+        if ( (m_acknowledged.end() == it) || (m_batches.empty() ? (it->second != m_sequence) : (it->second + 1 < m_batches.front().sequence)) ) {
+            return false;
+        }
+        for (const auto &b : m_batches) {
+            if (it->second < b.sequence) {
+                delegate(b.sequence, b.frames);
+            }
+        }
+        return true;
+    }
+
+   private:
+    static constexpr std::size_t MAX_SESSIONS{1024};
+
+    std::size_t m_maxSize;
+    std::size_t m_size{0};
+    uint64_t m_sequence{0};
+    std::deque<Batch> m_batches{};
+    std::unordered_map<uint64_t, uint64_t> m_acknowledged{};
+};
+
+/**
+ * This class tracks the session of a TCP client across connections: It
+ * acknowledges the received batches and, after reconnecting, suppresses the
+ * Envelopes until the server has answered the resume request, as well as the
+ * Envelopes of batches that were received already.
+ *
+ * The frames are to be passed in the order they are received; ackFrame may be
+ * called from another thread.
+ */
+class Tracker {
+   private:
+    Tracker(const Tracker &) = delete;
+    Tracker(Tracker &&)      = delete;
+    Tracker &operator=(const Tracker &) = delete;
+    Tracker &operator=(Tracker &&) = delete;
+
+   public:
+    explicit Tracker(uint64_t session) noexcept
+        : m_session{session} {}
+
+    /**
+     * This method is to be called for every new connection before its first frame.
+     *
+     * @return Frame to be sent to the server first, if any.
+     */
+    std::string connect() noexcept {
+        std::string retVal;
+        m_lastAcknowledged = 0;
+        m_isResumed = !m_hasSequences;
+        m_isAccepting = m_isResumed;
+        if (m_hasSequences) {
+            retVal = resumeFrame(m_session);
+        }
+        return retVal;
+    }
+
+    /**
+     * This method is to be called for every extension frame that does not carry Envelopes.
+     */
+    void onExtension(const char *data, std::size_t length) noexcept {
+        uint64_t value{0};
+        if (parse(data, length, od4::ExtensionType::SEQUENCE, &value, 1)) {
+            m_hasSequences = true;
+            m_isAccepting = m_isResumed && (m_lastReceived.load() < value);
+            if (m_isAccepting) {
+                m_lastReceived.store(value);
+            }
+        }
+        else if (parse(data, length, od4::ExtensionType::RESUME, &value, 1)) {
+            // After a gap, e.g., when the server was restarted, its sequences may start over.
+            if (0 == value) {
+                m_lastReceived.store(0);
+            }
+            m_isResumed = true;
+            m_isAccepting = true;
+        }
+    }
+
+    /**
+     * @return true if the Envelopes received now are to be forwarded.
+     */
+    bool isAccepting() const noexcept {
+        return m_isAccepting;
+    }
+
+    /**
+     * @return Frame to acknowledge the batches received since the last call, if any.
+     */
+    std::string ackFrame() noexcept {
+        std::string retVal;
+        const uint64_t LAST_RECEIVED{m_lastReceived.load()};
+        if (m_lastAcknowledged != LAST_RECEIVED) {
+            m_lastAcknowledged = LAST_RECEIVED;
+            retVal = session::ackFrame(m_session, LAST_RECEIVED);
+        }
+        return retVal;
+    }
+
+   private:
+    const uint64_t m_session;
+    bool m_hasSequences{false};
+    bool m_isResumed{true};
+    bool m_isAccepting{true};
+    std::atomic<uint64_t> m_lastReceived{0};
+    uint64_t m_lastAcknowledged{0};
+};
+
+} // namespace session
+
+#endif
@@ -0,0 +1,144 @@
+/*
+ * Copyright (C) 2021  Christian Berger
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SNAPSHOT_CACHE_HPP
+#define SNAPSHOT_CACHE_HPP
+
+#include "od4-frame.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+/**
+ * This class keeps the last serialized Envelope of every stream (dataType and
+ * senderStamp) of the configured dataTypes so that clients connecting later
+ * do not have to wait for the next Envelope of slowly published streams, e.g.,
+ * maps or configurations. For every dataType, at most the configured number
+ * of streams is kept; the stream that was updated longest ago makes room for
+ * a new one. The snapshot is ordered as the Envelopes were relayed.
+ *
+ * This class is not thread-safe.
+ */
+class SnapshotCache {
+   private:
+    SnapshotCache(const SnapshotCache &) = delete;
+    SnapshotCache(SnapshotCache &&)      = delete;
+    SnapshotCache &operator=(const SnapshotCache &) = delete;
+    SnapshotCache &operator=(SnapshotCache &&) = delete;
+
+   private:
+    struct Entry {
+        uint64_t updated{0};
+        uint32_t channel{0};
+        od4::SharedFrame frame{};
+    };
+
+   public:
+    /**
+     * @param maxStreamsPerDataType Cached dataTypes and how many streams to keep for each.
+     */
+    explicit SnapshotCache(const std::unordered_map<int32_t, uint32_t> &maxStreamsPerDataType) noexcept
+        : m_maxStreamsPerDataType{maxStreamsPerDataType} {}
+
+    /**
+     * This method updates the cache with the Envelopes of a batch before it is encoded.
+     */
+    void update(const std::vector<od4::SharedFrame> &frames) noexcept {
+        // A batch starts on channel 0 unless it starts with a channel frame.
+        uint32_t channel{0};
+        for (const auto &f : frames) {
+            od4::EnvelopeInfo info;
+            if (od4::channelOf(f->data(), f->size(), channel)) {
+                m_hasChannels = true;
+                continue;
+            }
+            if (!od4::peek(f->data(), f->size(), info)) {
+                continue;
+            }
+            const auto LIMIT = m_maxStreamsPerDataType.find(info.dataType);
+            if (LIMIT == m_maxStreamsPerDataType.end()) {
+                continue;
+            }
+            auto &streams = m_streams[info.dataType];
+            const uint64_t STREAM{(static_cast<uint64_t>(channel) << 32) | info.senderStamp};
+            if ( (streams.end() == streams.find(STREAM)) && (LIMIT->second <= streams.size()) ) {
+                auto oldest = std::min_element(streams.begin(), streams.end(), [](const std::pair<const uint64_t, Entry> &a, const std::pair<const uint64_t, Entry> &b) {
+                    return a.second.updated < b.second.updated;
+                });
+                if (oldest != streams.end()) {
+                    streams.erase(oldest);
+                }
+            }
+            auto &e = streams[STREAM];
+            e.updated = ++m_updates;
+            e.channel = channel;
+            e.frame = f;
+        }
+    }
+
+    /**
+     * @return Number of Envelopes cached so far, which tells snapshot the Envelopes relayed later.
+     */
+    uint64_t updates() const noexcept {
+        return m_updates;
+    }
+
+    /**
+     * @param lastUpdate Leave out the streams updated after this number of updates,
+     *        e.g., because their last Envelope was relayed to the client already.
+     * @return Cached Envelopes in the order they were relayed, preceded by channel frames where needed.
+     */
+    std::vector<od4::SharedFrame> snapshot(uint64_t lastUpdate = UINT64_MAX) const noexcept {
+        std::vector<const Entry*> entries;
+        for (const auto &streams : m_streams) {
+            for (const auto &s : streams.second) {
+                if (s.second.updated <= lastUpdate) {
+                    entries.push_back(&s.second);
+                }
+            }
+        }
+        std::sort(entries.begin(), entries.end(), [](const Entry *a, const Entry *b) {
+            return a->updated < b->updated;
+        });
+
+        std::vector<od4::SharedFrame> retVal;
+        bool isFirst{true};
+        uint32_t channel{0};
+        for (const auto e : entries) {
+            if (m_hasChannels && (isFirst || (channel != e->channel))) {
+                retVal.emplace_back(std::make_shared<const std::string>(od4::channelFrame(e->channel)));
+                channel = e->channel;
+            }
+            isFirst = false;
+            retVal.push_back(e->frame);
+        }
+        return retVal;
+    }
+
+   private:
+    std::unordered_map<int32_t, uint32_t> m_maxStreamsPerDataType;
+    std::unordered_map<int32_t, std::unordered_map<uint64_t, Entry>> m_streams{};
+    uint64_t m_updates{0};
+    bool m_hasChannels{false};
+};
+
+#endif
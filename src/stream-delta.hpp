@@ -0,0 +1,227 @@
+/*
+ * Copyright (C) 2021  Christian Berger
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef STREAM_DELTA_HPP
+#define STREAM_DELTA_HPP
+
+#include "od4-frame.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+/**
+ * Consecutive Envelopes of the same stream (dataType and senderStamp) often
+ * differ in a few bytes only, e.g., in their time stamps and some fields of
+ * their payload. A delta frame encodes a serialized Envelope as the byte
+ * differences to the previous Envelope of its stream:
+ *
+ *    0x0D 0xA5 LEN TYPE=2 dataType senderStamp sequence kind length ops
+ *
+ * where all fields but kind (0: keyframe, 1: delta to sequence - 1) are
+ * varints and ops is a list of (number of bytes to copy from the previous
+ * Envelope, number of literal bytes, literal bytes) up to length bytes.
+ * A keyframe has no previous Envelope and consists of literal bytes only.
+ */
+namespace delta {
+
+enum class Kind : uint8_t { KEYFRAME = 0, DELTA = 1 };
+
+// Delta frames are sent as UDP datagrams after decoding.
+constexpr std::size_t MAX_FRAME_SIZE{65507};
+// Equal bytes within changed bytes are only worth an operation of their own from this length on.
+constexpr std::size_t MIN_COPY{4};
+
+inline uint64_t streamOf(const od4::EnvelopeInfo &info) noexcept {
+    return (static_cast<uint64_t>(static_cast<uint32_t>(info.dataType)) << 32) | info.senderStamp;
+}
+
+inline std::size_t equalBytes(const std::string &a, const std::string &b, std::size_t pos) noexcept {
+    std::size_t i{pos};
+    while ( (i < a.size()) && (i < b.size()) && (a[i] == b[i]) ) {
+        i++;
+    }
+    return i - pos;
+}
+
+/**
+ * This class replaces the frames of a batch by delta frames and sends a
+ * keyframe for every stream at the given interval so that clients that
+ * missed a frame or connected later can resume decoding.
+ */
+class DeltaEncoder {
+   private:
+    DeltaEncoder(const DeltaEncoder &) = delete;
+    DeltaEncoder(DeltaEncoder &&)      = delete;
+    DeltaEncoder &operator=(const DeltaEncoder &) = delete;
+    DeltaEncoder &operator=(DeltaEncoder &&) = delete;
+
+   private:
+    struct Stream {
+        uint64_t sequence{0};
+        uint32_t framesSinceKeyframe{0};
+        od4::SharedFrame previous{};
+    };
+
+   public:
+    /**
+     * @param keyframeInterval Send every keyframeInterval-th frame of a stream as keyframe.
+     */
+    explicit DeltaEncoder(uint32_t keyframeInterval) noexcept
+        : m_keyframeInterval{std::max<uint32_t>(keyframeInterval, 1)} {}
+
+    void process(std::vector<od4::SharedFrame> &frames) noexcept {
+        // Streams are distinguished per channel; a batch starts on channel 0 unless it starts with a channel frame.
+        uint32_t channel{0};
+        for (auto &f : frames) {
+            od4::EnvelopeInfo info;
+            if (od4::channelOf(f->data(), f->size(), channel)) {
+                continue;
+            }
+            if ( (MAX_FRAME_SIZE < f->size()) || !od4::peek(f->data(), f->size(), info) ) {
+                continue;
+            }
+            Stream &s{m_streams[channel][streamOf(info)]};
+            const bool IS_KEYFRAME{!s.previous || (m_keyframeInterval <= ++s.framesSinceKeyframe)};
+            s.framesSinceKeyframe = IS_KEYFRAME ? 0 : s.framesSinceKeyframe;
+            s.sequence++;
+
+            std::string frame{od4::beginExtension(od4::ExtensionType::DELTA)};
+            od4::writeVarInt(frame, static_cast<uint32_t>(info.dataType));
+            od4::writeVarInt(frame, info.senderStamp);
+            od4::writeVarInt(frame, s.sequence);
+            frame.push_back(static_cast<char>(IS_KEYFRAME ? Kind::KEYFRAME : Kind::DELTA));
+            od4::writeVarInt(frame, f->size());
+            encode(IS_KEYFRAME ? m_empty : *s.previous, *f, frame);
+            od4::finishExtension(frame);
+
+            // The frame that was sent is the previous one for the next delta.
+            s.previous = std::move(f);
+            f = std::make_shared<const std::string>(std::move(frame));
+        }
+    }
+
+   private:
+    static void encode(const std::string &previous, const std::string &current, std::string &out) noexcept {
+        std::size_t pos{0};
+        while (pos < current.size()) {
+            const std::size_t COPY{equalBytes(previous, current, pos)};
+            std::size_t end{pos + COPY};
+            while ( (end < current.size()) && (MIN_COPY > equalBytes(previous, current, end)) ) {
+                end++;
+            }
+            od4::writeVarInt(out, COPY);
+            od4::writeVarInt(out, end - pos - COPY);
+            out.append(current, pos + COPY, end - pos - COPY);
+            pos = end;
+        }
+    }
+
+   private:
+    const std::string m_empty{};
+    uint32_t m_keyframeInterval;
+    std::unordered_map<uint32_t, std::unordered_map<uint64_t, Stream>> m_streams{};
+};
+
+/**
+ * This class restores the serialized Envelopes from delta frames; deltas to
+ * an Envelope that was not received are dropped until the next keyframe.
+ */
+class DeltaDecoder {
+   private:
+    DeltaDecoder(const DeltaDecoder &) = delete;
+    DeltaDecoder(DeltaDecoder &&)      = delete;
+    DeltaDecoder &operator=(const DeltaDecoder &) = delete;
+    DeltaDecoder &operator=(DeltaDecoder &&) = delete;
+
+   private:
+    struct Stream {
+        uint64_t sequence{0};
+        std::string previous{};
+    };
+
+   public:
+    DeltaDecoder() = default;
+
+    /**
+     * @param channel Channel the given frame belongs to.
+     * @param out Receives the serialized Envelope.
+     * @return false if the given frame is malformed or cannot be decoded.
+     */
+    bool decode(uint32_t channel, const char *frame, std::size_t length, std::string &out) noexcept {
+        std::size_t pos{od4::EXTENSION_HEADER_SIZE};
+        uint64_t dataType{0};
+        uint64_t senderStamp{0};
+        uint64_t sequence{0};
+        uint64_t size{0};
+        if ( !od4::isExtension(frame, length)
+             || (od4::ExtensionType::DELTA != od4::extensionType(frame))
+             || !od4::readVarInt(frame, length, pos, dataType)
+             || !od4::readVarInt(frame, length, pos, senderStamp)
+             || !od4::readVarInt(frame, length, pos, sequence)
+             || !(pos < length) ) {
+            return false;
+        }
+        const Kind KIND{static_cast<Kind>(frame[pos++])};
+        if ( !od4::readVarInt(frame, length, pos, size) || (MAX_FRAME_SIZE < size) ) {
+            return false;
+        }
+
+        Stream &s{m_streams[channel][(dataType << 32) | (senderStamp & 0xffffffff)]};
+        if ( (Kind::KEYFRAME != KIND) && ( (Kind::DELTA != KIND) || s.previous.empty() || (s.sequence + 1 != sequence) ) ) {
+            return false;
+        }
+        const std::string &PREVIOUS{(Kind::KEYFRAME == KIND) ? m_empty : s.previous};
+        out.clear();
+        out.reserve(static_cast<std::size_t>(size));
+        while (out.size() < size) {
+            uint64_t copy{0};
+            uint64_t literals{0};
+            if ( !od4::readVarInt(frame, length, pos, copy)
+                 || !od4::readVarInt(frame, length, pos, literals)
+                 || (size - out.size() < copy)
+                 || (size - out.size() - copy < literals)
+                 || (0 == copy + literals)
+                 || (PREVIOUS.size() < out.size() + copy)
+                 || (length - pos < literals) ) {
+                return false;
+            }
+            out.append(PREVIOUS, out.size(), static_cast<std::size_t>(copy));
+            out.append(frame + pos, static_cast<std::size_t>(literals));
+            pos += static_cast<std::size_t>(literals);
+        }
+        s.sequence = sequence;
+        s.previous = out;
+        return true;
+    }
+
+    void reset() noexcept {
+        m_streams.clear();
+    }
+
+   private:
+    const std::string m_empty{};
+    std::unordered_map<uint32_t, std::unordered_map<uint64_t, Stream>> m_streams{};
+};
+
+} // namespace delta
+
+#endif
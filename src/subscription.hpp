@@ -0,0 +1,241 @@
+/*
+ * Copyright (C) 2021  Christian Berger
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SUBSCRIPTION_HPP
+#define SUBSCRIPTION_HPP
+
+#include "compact-batch.hpp"
+#include "od4-frame.hpp"
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+/**
+ * A subscription (extension type 5) is sent by a TCP client to tell the
+ * server which Envelopes it wants to receive:
+ *
+ *    0x0D 0xA5 LEN TYPE=5 count entry*
+ *    entry: dataType senderStamp minimumInterval
+ *
+ * where all fields are varints: senderStamp is incremented by one so that 0
+ * stands for any senderStamp, and minimumInterval is the time in microseconds
+ * that must pass between two Envelopes of the same stream (0: all Envelopes).
+ */
+namespace subscription {
+
+struct Entry {
+    int32_t dataType{0};
+    bool isAnySenderStamp{true};
+    uint32_t senderStamp{0};
+    uint64_t minimumIntervalInMicroseconds{0};
+};
+
+// Limits the memory that a client can make the server allocate.
+constexpr std::size_t MAX_ENTRIES{4096};
+
+/**
+ * @return Subscription frame for the given entries.
+ */
+inline std::string frame(const std::vector<Entry> &entries) noexcept {
+    std::string frame{od4::beginExtension(od4::ExtensionType::SUBSCRIPTION)};
+    od4::writeVarInt(frame, entries.size());
+    for (const auto &e : entries) {
+        od4::writeVarInt(frame, static_cast<uint32_t>(e.dataType));
+        od4::writeVarInt(frame, e.isAnySenderStamp ? 0 : static_cast<uint64_t>(e.senderStamp) + 1);
+        od4::writeVarInt(frame, e.minimumIntervalInMicroseconds);
+    }
+    od4::finishExtension(frame);
+    return frame;
+}
+
+/**
+ * @return false if the given frame is not a valid subscription frame.
+ */
+inline bool parse(const char *data, std::size_t length, std::vector<Entry> &entries) noexcept {
+    std::size_t pos{od4::EXTENSION_HEADER_SIZE};
+    uint64_t count{0};
+    if ( !od4::isExtension(data, length) || (od4::ExtensionType::SUBSCRIPTION != od4::extensionType(data))
+         || !od4::readVarInt(data, length, pos, count) || (MAX_ENTRIES < count) ) {
+        return false;
+    }
+    entries.clear();
+    for (uint64_t i{0}; i < count; i++) {
+        uint64_t dataType{0};
+        uint64_t senderStamp{0};
+        Entry e;
+        if ( !od4::readVarInt(data, length, pos, dataType) || (0xffffffff < dataType)
+             || !od4::readVarInt(data, length, pos, senderStamp) || (0x100000000 < senderStamp)
+             || !od4::readVarInt(data, length, pos, e.minimumIntervalInMicroseconds) ) {
+            return false;
+        }
+        e.dataType = static_cast<int32_t>(static_cast<uint32_t>(dataType));
+        e.isAnySenderStamp = (0 == senderStamp);
+        e.senderStamp = e.isAnySenderStamp ? 0 : static_cast<uint32_t>(senderStamp - 1);
+        entries.push_back(e);
+    }
+    return true;
+}
+
+/**
+ * @return false if the given serialized Envelope has no valid sent time stamp.
+ */
+inline bool sentTimeStamp(const char *data, std::size_t length, int64_t &microseconds) noexcept {
+    const std::size_t LENGTH{od4::HEADER_SIZE + od4::payloadLength(data, length)};
+    if ( (od4::HEADER_SIZE == LENGTH) || (length < LENGTH) ) {
+        return false;
+    }
+    std::size_t pos{od4::HEADER_SIZE};
+    uint64_t key{0};
+    uint64_t value{0};
+    while ( (pos < LENGTH) && od4::readVarInt(data, LENGTH, pos, key) ) {
+        switch (key & 0x7) {
+            case 0: // VARINT
+                if (!od4::readVarInt(data, LENGTH, pos, value)) {
+                    return false;
+                }
+                continue;
+            case 1: // EIGHT_BYTES
+                value = 8;
+                break;
+            case 2: // LENGTH_DELIMITED
+                if (!od4::readVarInt(data, LENGTH, pos, value)) {
+                    return false;
+                }
+                break;
+            case 5: // FOUR_BYTES
+                value = 4;
+                break;
+            default:
+                return false;
+        }
+        if (LENGTH - pos < value) {
+            return false;
+        }
+        if ( (compact::SENT_FIELD == (key >> 3)) && (2 == (key & 0x7)) ) {
+            return compact::parseTimeStamp(data + pos, static_cast<std::size_t>(value), microseconds);
+        }
+        pos += static_cast<std::size_t>(value);
+    }
+    return false;
+}
+
+/**
+ * This class applies a client's subscription to the batches of the server:
+ * Envelopes that are not subscribed or that follow the previous Envelope of
+ * their stream earlier than its minimum interval are removed. The interval
+ * is measured by the Envelopes' sent time stamps where available so that the
+ * result does not depend on how the Envelopes were batched.
+ */
+class Filter {
+   private:
+    Filter(const Filter &) = delete;
+    Filter(Filter &&)      = delete;
+    Filter &operator=(const Filter &) = delete;
+    Filter &operator=(Filter &&) = delete;
+
+   public:
+    /**
+     * @param entries Subscribed Envelopes; without entries, all Envelopes are subscribed.
+     */
+    explicit Filter(const std::vector<Entry> &entries) noexcept
+        : m_isSubscribingAll{entries.empty()} {
+        for (const auto &e : entries) {
+            if (e.isAnySenderStamp) {
+                m_entriesByDataType[e.dataType] = e;
+            }
+            else {
+                m_entriesByStream[streamOf(e.dataType, e.senderStamp)] = e;
+            }
+        }
+    }
+
+    /**
+     * @param nowInMicroseconds Time to use for Envelopes without sent time stamp.
+     * @return Subscribed frames of the given batch; channel frames are kept for
+     *         the subscribed frames that follow them.
+     */
+    std::vector<od4::SharedFrame> apply(const std::vector<od4::SharedFrame> &frames, int64_t nowInMicroseconds) noexcept {
+        std::vector<od4::SharedFrame> retVal;
+        if (m_isSubscribingAll) {
+            retVal = frames;
+            return retVal;
+        }
+        uint32_t channel{0};
+        const od4::SharedFrame *pendingChannelFrame{nullptr};
+        for (const auto &f : frames) {
+            od4::EnvelopeInfo info;
+            if (od4::channelOf(f->data(), f->size(), channel)) {
+                pendingChannelFrame = &f;
+                continue;
+            }
+            if (!od4::peek(f->data(), f->size(), info) || !isSubscribed(channel, info, *f, nowInMicroseconds)) {
+                continue;
+            }
+            if (nullptr != pendingChannelFrame) {
+                retVal.push_back(*pendingChannelFrame);
+                pendingChannelFrame = nullptr;
+            }
+            retVal.push_back(f);
+        }
+        return retVal;
+    }
+
+   private:
+    static uint64_t streamOf(int32_t dataType, uint32_t senderStamp) noexcept {
+        return (static_cast<uint64_t>(static_cast<uint32_t>(dataType)) << 32) | senderStamp;
+    }
+
+    bool isSubscribed(uint32_t channel, const od4::EnvelopeInfo &info, const std::string &frame, int64_t nowInMicroseconds) noexcept {
+        const uint64_t STREAM{streamOf(info.dataType, info.senderStamp)};
+        auto it = m_entriesByStream.find(STREAM);
+        if (it == m_entriesByStream.end()) {
+            it = m_entriesByDataType.find(info.dataType);
+            if (it == m_entriesByDataType.end()) {
+                return false;
+            }
+        }
+        if (0 == it->second.minimumIntervalInMicroseconds) {
+            return true;
+        }
+
+        int64_t timeStamp{nowInMicroseconds};
+        if (!sentTimeStamp(frame.data(), frame.size(), timeStamp) || (0 == timeStamp)) {
+            timeStamp = nowInMicroseconds;
+        }
+        auto &last = m_lastTimeStamps[channel][STREAM];
+        // A time stamp from the past, e.g., after a restart of the sender, starts over.
+        if ( (0 != last) && (last <= timeStamp) && (static_cast<uint64_t>(timeStamp - last) < it->second.minimumIntervalInMicroseconds) ) {
+            return false;
+        }
+        last = timeStamp;
+        return true;
+    }
+
+   private:
+    bool m_isSubscribingAll;
+    std::unordered_map<uint64_t, Entry> m_entriesByStream{};
+    std::unordered_map<uint64_t, Entry> m_entriesByDataType{};
+    std::unordered_map<uint32_t, std::unordered_map<uint64_t, int64_t>> m_lastTimeStamps{};
+};
+
+} // namespace subscription
+
+#endif
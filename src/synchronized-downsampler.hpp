@@ -0,0 +1,180 @@
+/*
+ * Copyright (C) 2021  Christian Berger
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SYNCHRONIZED_DOWNSAMPLER_HPP
+#define SYNCHRONIZED_DOWNSAMPLER_HPP
+
+#include "cluon-complete.hpp"
+
+#include <cstdint>
+#include <functional>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+/**
+ * This class downsamples groups of Envelope IDs together: The first ID of a
+ * group is the reference that is decimated to every N-th Envelope; each kept
+ * reference Envelope starts a tick. For every other ID of the group, exactly
+ * one Envelope per tick is kept, namely the first one whose sampleTimeStamp is
+ * within the tolerance of the reference's sampleTimeStamp. As the matching
+ * Envelope might arrive before the reference, the most recent Envelope per ID
+ * is held back until it can be matched or is superseded. Envelopes of
+ * different channels, i.e., different source CIDs, are downsampled separately.
+ */
+class SynchronizedDownsampler {
+   private:
+    SynchronizedDownsampler(const SynchronizedDownsampler &) = delete;
+    SynchronizedDownsampler(SynchronizedDownsampler &&)      = delete;
+    SynchronizedDownsampler &operator=(const SynchronizedDownsampler &) = delete;
+    SynchronizedDownsampler &operator=(SynchronizedDownsampler &&) = delete;
+
+   public:
+    using Delegate = std::function<void(cluon::data::Envelope &&env, uint32_t hops, uint32_t priorityClass, uint32_t channel)>;
+
+   private:
+    struct Member {
+        bool hasHeldEnvelope{false};
+        cluon::data::Envelope heldEnvelope{};
+        uint32_t heldHops{0};
+        uint32_t heldPriorityClass{0};
+        bool isRelayedForTick{false};
+    };
+
+    // Ticks and held Envelopes of a group on one channel.
+    struct State {
+        uint32_t counter{1};
+        bool hasTick{false};
+        int64_t tickInMicroseconds{0};
+        std::unordered_map<int32_t, Member, cluon::UseUInt32ValueAsHashKey> members{};
+    };
+
+    struct Group {
+        std::vector<int32_t> dataTypes{};
+        uint32_t downsampling{1};
+        int64_t toleranceInMicroseconds{0};
+        std::unordered_map<uint32_t, State> states{};
+    };
+
+   public:
+    SynchronizedDownsampler() = default;
+
+    /**
+     * @param dataTypes IDs of the group; the first one is the reference.
+     * @param downsampling Keep every N-th Envelope of the reference.
+     * @param toleranceInMicroseconds Maximum distance of sampleTimeStamps to the reference.
+     */
+    void addGroup(std::vector<int32_t> &&dataTypes, uint32_t downsampling, int64_t toleranceInMicroseconds) noexcept {
+        if (!dataTypes.empty() && (0 < downsampling)) {
+            Group g;
+            g.dataTypes = std::move(dataTypes);
+            g.downsampling = downsampling;
+            g.toleranceInMicroseconds = toleranceInMicroseconds;
+            for (auto id : g.dataTypes) {
+                m_groupOfDataType[id] = m_groups.size();
+            }
+            m_groups.emplace_back(std::move(g));
+        }
+    }
+
+    bool empty() const noexcept {
+        return m_groups.empty();
+    }
+
+    bool isSynchronized(int32_t dataType) const noexcept {
+        return (0 < m_groupOfDataType.count(dataType));
+    }
+
+    /**
+     * @return Reference ID of the group the given ID belongs to.
+     */
+    int32_t referenceOf(int32_t dataType) const noexcept {
+        auto it = m_groupOfDataType.find(dataType);
+        return (it != m_groupOfDataType.end()) ? m_groups[it->second].dataTypes[0] : dataType;
+    }
+
+    /**
+     * This method decides about an Envelope of a synchronized ID and calls
+     * delegate for all Envelopes that are to be relayed now.
+     */
+    void process(cluon::data::Envelope &&env, uint32_t hops, uint32_t priorityClass, uint32_t channel, const Delegate &delegate) noexcept {
+        auto it = m_groupOfDataType.find(env.dataType());
+        if (it == m_groupOfDataType.end()) {
+            return;
+        }
+        Group &g{m_groups[it->second]};
+        auto st = g.states.find(channel);
+        if (st == g.states.end()) {
+            State state;
+            state.counter = g.downsampling;
+            for (std::size_t i{1}; i < g.dataTypes.size(); i++) {
+                state.members[g.dataTypes[i]] = Member();
+            }
+            st = g.states.emplace(channel, std::move(state)).first;
+        }
+        State &state{st->second};
+        const int64_t TIMESTAMP{cluon::time::toMicroseconds(env.sampleTimeStamp())};
+
+        if (g.dataTypes[0] == env.dataType()) {
+            state.counter--;
+            if (0 == state.counter) {
+                // Start a new tick and release the held Envelopes that match it.
+                state.counter = g.downsampling;
+                state.hasTick = true;
+                state.tickInMicroseconds = TIMESTAMP;
+                delegate(std::move(env), hops, priorityClass, channel);
+                for (auto &m : state.members) {
+                    m.second.isRelayedForTick = false;
+                    if (m.second.hasHeldEnvelope) {
+                        m.second.hasHeldEnvelope = false;
+                        if (isWithinTolerance(g, state, cluon::time::toMicroseconds(m.second.heldEnvelope.sampleTimeStamp()))) {
+                            m.second.isRelayedForTick = true;
+                            delegate(std::move(m.second.heldEnvelope), m.second.heldHops, m.second.heldPriorityClass, channel);
+                        }
+                        m.second.heldEnvelope = cluon::data::Envelope();
+                    }
+                }
+            }
+        }
+        else {
+            Member &m{state.members[env.dataType()]};
+            if (state.hasTick && !m.isRelayedForTick && isWithinTolerance(g, state, TIMESTAMP)) {
+                m.isRelayedForTick = true;
+                delegate(std::move(env), hops, priorityClass, channel);
+            }
+            else if (!state.hasTick || (state.tickInMicroseconds + g.toleranceInMicroseconds < TIMESTAMP)) {
+                // Might match the next tick.
+                m.hasHeldEnvelope = true;
+                m.heldEnvelope = std::move(env);
+                m.heldHops = hops;
+                m.heldPriorityClass = priorityClass;
+            }
+        }
+    }
+
+   private:
+    static bool isWithinTolerance(const Group &g, const State &state, int64_t timestampInMicroseconds) noexcept {
+        const int64_t DELTA{timestampInMicroseconds - state.tickInMicroseconds};
+        return ( (-g.toleranceInMicroseconds <= DELTA) && (DELTA <= g.toleranceInMicroseconds) );
+    }
+
+   private:
+    std::vector<Group> m_groups{};
+    std::unordered_map<int32_t, std::size_t, cluon::UseUInt32ValueAsHashKey> m_groupOfDataType{};
+};
+
+#endif
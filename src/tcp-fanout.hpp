@@ -0,0 +1,509 @@
+/*
+ * Copyright (C) 2021  Christian Berger
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TCP_FANOUT_HPP
+#define TCP_FANOUT_HPP
+
+#include "od4-frame.hpp"
+
+#include <arpa/inet.h>
+#include <linux/sockios.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+/**
+ * This class accepts TCP clients on a port and sends the same data to all of
+ * them. Every client has its own bounded queue that is drained by non-blocking
+ * writes from an epoll thread, so a slow or stalled client never blocks the
+ * caller or the other clients. When a client's queue is full, the overflow
+ * policy decides: DROP discards the new data for that client, CONFLATE
+ * discards the queued data that has not been started yet in favor of the new
+ * data, and DISCONNECT closes the connection to the client.
+ *
+ * Data that clients send is passed to the optional onNewData delegate, which
+ * is called from the epoll thread like onNewClient and onClientLost.
+ * Detached clients do not receive the data for all clients anymore but only
+ * the data that is sent to them individually, e.g., after subscribing.
+ */
+class TCPFanout {
+   private:
+    TCPFanout(const TCPFanout &) = delete;
+    TCPFanout(TCPFanout &&)      = delete;
+    TCPFanout &operator=(const TCPFanout &) = delete;
+    TCPFanout &operator=(TCPFanout &&) = delete;
+
+   public:
+    enum class OverflowPolicy { DROP, CONFLATE, DISCONNECT };
+
+   private:
+    struct Client {
+        int socket{-1};
+        std::string address{};
+        std::mutex queueMutex{};
+        std::deque<od4::SharedFrame> queue{};
+        std::size_t offset{0}; // Bytes of queue.front() that are sent already.
+        std::size_t queuedBytes{0};
+        bool isWaitingForWritable{false};
+        bool isToBeClosed{false};
+        bool isDetached{false};
+    };
+
+    using Clients = std::vector<std::shared_ptr<Client>>;
+
+   public:
+    /**
+     * @param port TCP port to listen on.
+     * @param maxQueuedBytesPerClient Maximum number of bytes waiting to be sent to one client.
+     * @param overflowPolicy What to do when a client's queue is full.
+     * @param sendBufferSize Size of the clients' socket send buffers (0: system default).
+     * @param onNewClient Called with the client's address when a client has connected.
+     * @param onClientLost Called with the client's address when a client is gone.
+     * @param onNewData Called with the client's address and the bytes received from it.
+     */
+    TCPFanout(uint16_t port, std::size_t maxQueuedBytesPerClient, OverflowPolicy overflowPolicy, std::size_t sendBufferSize,
+              std::function<void(const std::string &)> onNewClient, std::function<void(const std::string &)> onClientLost,
+              std::function<void(const std::string &, const char *, std::size_t)> onNewData = nullptr) noexcept
+        : m_maxQueuedBytesPerClient{maxQueuedBytesPerClient}
+        , m_overflowPolicy{overflowPolicy}
+        , m_sendBufferSize{sendBufferSize}
+        , m_onNewClient(std::move(onNewClient))
+        , m_onClientLost(std::move(onClientLost))
+        , m_onNewData(std::move(onNewData)) {
+        m_socket = ::socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP);
+        if (!(m_socket < 0)) {
+            int yes{1};
+            ::setsockopt(m_socket, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+
+            struct sockaddr_in address;
+            std::memset(&address, 0, sizeof(address));
+            address.sin_family      = AF_INET;
+            address.sin_addr.s_addr = htonl(INADDR_ANY);
+            address.sin_port        = htons(port);
+            if ( (0 != ::bind(m_socket, reinterpret_cast<struct sockaddr *>(&address), sizeof(address)))
+                 || (0 != ::listen(m_socket, MAX_PENDING_CONNECTIONS)) ) {
+                ::close(m_socket);
+                m_socket = -1;
+            }
+        }
+        m_epoll = ::epoll_create1(EPOLL_CLOEXEC);
+        m_wakeup = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if ( !(m_socket < 0) && !(m_epoll < 0) && !(m_wakeup < 0) ) {
+            watch(m_socket, EPOLLIN);
+            watch(m_wakeup, EPOLLIN);
+            m_running.store(true);
+            m_thread = std::thread(&TCPFanout::run, this);
+        }
+    }
+
+    ~TCPFanout() {
+        m_running.store(false);
+        wakeup();
+        try {
+            if (m_thread.joinable()) {
+                m_thread.join();
+            }
+        } catch (...) {}
+
+        const auto CLIENTS{clients()};
+        for (auto &c : *CLIENTS) {
+            if (!(c->socket < 0)) {
+                ::close(c->socket);
+            }
+        }
+        std::atomic_store(&m_clients, std::make_shared<const Clients>());
+        for (int fd : {m_wakeup, m_epoll, m_socket}) {
+            if (!(fd < 0)) {
+                ::close(fd);
+            }
+        }
+    }
+
+   public:
+    bool isRunning() const noexcept {
+        return m_running.load();
+    }
+
+    std::size_t numberOfClients() const noexcept {
+        return m_numberOfClients.load();
+    }
+
+    /**
+     * @return Total number of bytes written to all clients so far.
+     */
+    uint64_t bytesSent() const noexcept {
+        return m_bytesSent.load();
+    }
+
+    /**
+     * @return Largest number of bytes waiting for one client, i.e., in its
+     *         queue and not yet sent by the kernel (SIOCOUTQ).
+     */
+    std::size_t backlog() const noexcept {
+        std::size_t retVal{0};
+        const auto CLIENTS{clients()};
+        for (auto &c : *CLIENTS) {
+            std::lock_guard<std::mutex> lck(c->queueMutex);
+            int unsent{0};
+            if ( (c->socket < 0) || (0 != ::ioctl(c->socket, SIOCOUTQ, &unsent)) ) {
+                unsent = 0;
+            }
+            retVal = std::max(retVal, c->queuedBytes + static_cast<std::size_t>(unsent));
+        }
+        return retVal;
+    }
+
+    /**
+     * This method queues a batch of frames for all connected clients and returns
+     * immediately. The frames are shared among the clients and sent without
+     * copying them into a contiguous buffer.
+     */
+    void send(std::vector<od4::SharedFrame> &&frames) noexcept {
+        const std::size_t SIZE{sizeOf(frames)};
+        if (0 == SIZE) {
+            return;
+        }
+        {
+            const auto CLIENTS{clients()};
+            for (auto &c : *CLIENTS) {
+                std::lock_guard<std::mutex> lck(c->queueMutex);
+                if (!c->isDetached) {
+                    enqueue(*c, frames, SIZE);
+                }
+            }
+        }
+        wakeup();
+    }
+
+    /**
+     * This method queues a batch of frames for the client with the given address only.
+     */
+    void sendTo(const std::string &address, std::vector<od4::SharedFrame> &&frames) noexcept {
+        const std::size_t SIZE{sizeOf(frames)};
+        if (0 == SIZE) {
+            return;
+        }
+        {
+            const auto CLIENTS{clients()};
+            for (auto &c : *CLIENTS) {
+                if (address == c->address) {
+                    std::lock_guard<std::mutex> lck(c->queueMutex);
+                    enqueue(*c, frames, SIZE);
+                }
+            }
+        }
+        wakeup();
+    }
+
+    /**
+     * This method excludes the client with the given address from send.
+     */
+    void detach(const std::string &address) noexcept {
+        const auto CLIENTS{clients()};
+        for (auto &c : *CLIENTS) {
+            if (address == c->address) {
+                std::lock_guard<std::mutex> lck(c->queueMutex);
+                c->isDetached = true;
+            }
+        }
+    }
+
+   private:
+    static std::size_t sizeOf(const std::vector<od4::SharedFrame> &frames) noexcept {
+        std::size_t size{0};
+        for (const auto &f : frames) {
+            size += f->size();
+        }
+        return size;
+    }
+
+    // Must be called with c.queueMutex held.
+    void enqueue(Client &c, const std::vector<od4::SharedFrame> &frames, std::size_t size) noexcept {
+        if (c.isToBeClosed) {
+            return;
+        }
+        // Data larger than the queue is accepted when the queue is empty.
+        if ( !c.queue.empty() && (m_maxQueuedBytesPerClient < c.queuedBytes + size) ) {
+            if (OverflowPolicy::DROP == m_overflowPolicy) {
+                return;
+            }
+            if (OverflowPolicy::DISCONNECT == m_overflowPolicy) {
+                c.isToBeClosed = true;
+                c.queue.clear();
+                c.queuedBytes = 0;
+                return;
+            }
+            // CONFLATE: Keep only the frame that is partially sent already.
+            while (c.queue.size() > ((0 < c.offset) ? 1u : 0u)) {
+                c.queuedBytes -= c.queue.back()->size();
+                c.queue.pop_back();
+            }
+        }
+        c.queuedBytes += size;
+        c.queue.insert(c.queue.end(), frames.begin(), frames.end());
+    }
+
+    std::shared_ptr<const Clients> clients() const noexcept {
+        return std::atomic_load(&m_clients);
+    }
+
+    void publish(std::shared_ptr<const Clients> &&updatedClients) noexcept {
+        m_numberOfClients.store(updatedClients->size());
+        std::atomic_store(&m_clients, std::move(updatedClients));
+    }
+
+    void watch(int fd, uint32_t events) noexcept {
+        struct epoll_event ev;
+        std::memset(&ev, 0, sizeof(ev));
+        ev.events = events;
+        ev.data.fd = fd;
+        ::epoll_ctl(m_epoll, EPOLL_CTL_ADD, fd, &ev);
+    }
+
+    void rewatch(int fd, uint32_t events) noexcept {
+        struct epoll_event ev;
+        std::memset(&ev, 0, sizeof(ev));
+        ev.events = events;
+        ev.data.fd = fd;
+        ::epoll_ctl(m_epoll, EPOLL_CTL_MOD, fd, &ev);
+    }
+
+    void wakeup() noexcept {
+        // Coalesce wakeups while the epoll thread has not picked up the previous one.
+        if (!m_isWakeupPending.exchange(true)) {
+            const uint64_t ONE{1};
+            ssize_t n = ::write(m_wakeup, &ONE, sizeof(ONE));
+            (void)n;
+        }
+    }
+
+    void acceptClients() noexcept {
+        struct sockaddr_in address;
+        socklen_t length{sizeof(address)};
+        int s{-1};
+        while (!((s = ::accept4(m_socket, reinterpret_cast<struct sockaddr *>(&address), &length, SOCK_NONBLOCK | SOCK_CLOEXEC)) < 0)) {
+            // Batching is done by the caller; do not delay the batches any further.
+            int yes{1};
+            ::setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+            if (0 < m_sendBufferSize) {
+                // The kernel limits this value to net.core.wmem_max.
+                int size{static_cast<int>(m_sendBufferSize)};
+                ::setsockopt(s, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+            }
+
+            auto c{std::make_shared<Client>()};
+            c->socket = s;
+            char buffer[INET_ADDRSTRLEN];
+            c->address = std::string(::inet_ntop(AF_INET, &address.sin_addr, buffer, sizeof(buffer))) + ":" + std::to_string(ntohs(address.sin_port));
+            watch(s, EPOLLIN | EPOLLRDHUP);
+            m_clientsBySocket[s] = c;
+            {
+                auto updatedClients{std::make_shared<Clients>(*clients())};
+                updatedClients->push_back(c);
+                publish(std::move(updatedClients));
+            }
+            if (nullptr != m_onNewClient) {
+                m_onNewClient(c->address);
+            }
+            length = sizeof(address);
+        }
+    }
+
+    void removeClient(int s) noexcept {
+        auto it = m_clientsBySocket.find(s);
+        if (it == m_clientsBySocket.end()) {
+            return;
+        }
+        auto c{it->second};
+        m_clientsBySocket.erase(it);
+        {
+            auto updatedClients{std::make_shared<Clients>(*clients())};
+            updatedClients->erase(std::remove(updatedClients->begin(), updatedClients->end(), c), updatedClients->end());
+            publish(std::move(updatedClients));
+        }
+        ::epoll_ctl(m_epoll, EPOLL_CTL_DEL, s, nullptr);
+        {
+            std::lock_guard<std::mutex> lck(c->queueMutex);
+            ::close(s);
+            c->socket = -1;
+        }
+        if (nullptr != m_onClientLost) {
+            m_onClientLost(c->address);
+        }
+    }
+
+    // @return false if the connection to the client is to be closed.
+    bool sendQueued(Client &c) noexcept {
+        std::lock_guard<std::mutex> lck(c.queueMutex);
+        while (!c.isToBeClosed && !c.queue.empty()) {
+            // Gather as many queued frames as possible into one system call.
+            m_iovecs.clear();
+            for (std::size_t i{0}; (i < c.queue.size()) && (m_iovecs.size() < MAX_IOVECS); i++) {
+                const std::string &frame{*c.queue[i]};
+                struct iovec iov;
+                iov.iov_base = const_cast<char*>(frame.data()) + ((0 == i) ? c.offset : 0);
+                iov.iov_len = frame.size() - ((0 == i) ? c.offset : 0);
+                m_iovecs.push_back(iov);
+            }
+            struct msghdr msg;
+            std::memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = m_iovecs.data();
+            msg.msg_iovlen = m_iovecs.size();
+            const ssize_t SENT{::sendmsg(c.socket, &msg, MSG_NOSIGNAL | MSG_DONTWAIT)};
+            if (0 > SENT) {
+                if (EINTR == errno) {
+                    continue;
+                }
+                if ( (EAGAIN == errno) || (EWOULDBLOCK == errno) ) {
+                    if (!c.isWaitingForWritable) {
+                        c.isWaitingForWritable = true;
+                        rewatch(c.socket, EPOLLIN | EPOLLRDHUP | EPOLLOUT);
+                    }
+                    return true;
+                }
+                c.isToBeClosed = true;
+                break;
+            }
+            m_bytesSent += static_cast<uint64_t>(SENT);
+            // Release the frames that were sent completely.
+            std::size_t sent{static_cast<std::size_t>(SENT)};
+            while (0 < sent) {
+                const std::size_t REMAINING{c.queue.front()->size() - c.offset};
+                if (sent < REMAINING) {
+                    c.offset += sent;
+                    break;
+                }
+                sent -= REMAINING;
+                c.queuedBytes -= c.queue.front()->size();
+                c.offset = 0;
+                c.queue.pop_front();
+            }
+        }
+        if (c.isWaitingForWritable) {
+            c.isWaitingForWritable = false;
+            rewatch(c.socket, EPOLLIN | EPOLLRDHUP);
+        }
+        return !c.isToBeClosed;
+    }
+
+    void run() noexcept {
+        constexpr int MAX_EVENTS{64};
+        struct epoll_event events[MAX_EVENTS];
+        std::vector<char> buffer(RECEIVE_BUFFER_SIZE);
+        while (m_running.load()) {
+            const int N{::epoll_wait(m_epoll, events, MAX_EVENTS, -1)};
+            for (int i{0}; i < N; i++) {
+                const int FD{events[i].data.fd};
+                if (FD == m_socket) {
+                    acceptClients();
+                }
+                else if (FD == m_wakeup) {
+                    uint64_t value{0};
+                    ssize_t n = ::read(m_wakeup, &value, sizeof(value));
+                    (void)n;
+                    m_isWakeupPending.store(false);
+
+                    const auto CLIENTS{clients()};
+                    for (auto &c : *CLIENTS) {
+                        bool isToBeClosed{false};
+                        {
+                            std::lock_guard<std::mutex> lck(c->queueMutex);
+                            isToBeClosed = c->isToBeClosed;
+                        }
+                        // Clients that are waiting to become writable are served by EPOLLOUT.
+                        if (isToBeClosed || (!c->isWaitingForWritable && !sendQueued(*c))) {
+                            removeClient(c->socket);
+                        }
+                    }
+                }
+                else {
+                    auto it = m_clientsBySocket.find(FD);
+                    if (it == m_clientsBySocket.end()) {
+                        continue;
+                    }
+                    auto c{it->second};
+                    bool isLost{0 != (events[i].events & (EPOLLERR | EPOLLHUP))};
+                    if (!isLost && (0 != (events[i].events & (EPOLLIN | EPOLLRDHUP)))) {
+                        // A closed connection reads as 0 bytes.
+                        const ssize_t RECEIVED{::recv(FD, buffer.data(), buffer.size(), MSG_DONTWAIT)};
+                        isLost = (0 == RECEIVED) || ( (0 > RECEIVED) && (EAGAIN != errno) && (EWOULDBLOCK != errno) && (EINTR != errno) );
+                        if ( (0 < RECEIVED) && (nullptr != m_onNewData) ) {
+                            m_onNewData(c->address, buffer.data(), static_cast<std::size_t>(RECEIVED));
+                        }
+                    }
+                    if (!isLost && (0 != (events[i].events & EPOLLOUT))) {
+                        isLost = !sendQueued(*c);
+                    }
+                    if (isLost) {
+                        removeClient(FD);
+                    }
+                }
+            }
+        }
+    }
+
+   private:
+    static constexpr int MAX_PENDING_CONNECTIONS{100};
+    static constexpr std::size_t MAX_IOVECS{256};
+    static constexpr std::size_t RECEIVE_BUFFER_SIZE{64 * 1024};
+
+    std::size_t m_maxQueuedBytesPerClient;
+    OverflowPolicy m_overflowPolicy;
+    std::size_t m_sendBufferSize;
+    std::function<void(const std::string &)> m_onNewClient;
+    std::function<void(const std::string &)> m_onClientLost;
+    std::function<void(const std::string &, const char *, std::size_t)> m_onNewData;
+
+    int m_socket{-1};
+    int m_epoll{-1};
+    int m_wakeup{-1};
+    std::atomic<bool> m_isWakeupPending{false};
+
+    // Copy-on-write list of clients: it is only changed from the epoll thread by
+    // publishing a new list; senders work on the list that was current when they started.
+    std::shared_ptr<const Clients> m_clients{std::make_shared<const Clients>()};
+    std::atomic<std::size_t> m_numberOfClients{0};
+    std::atomic<uint64_t> m_bytesSent{0};
+    // Only used from the epoll thread.
+    std::unordered_map<int, std::shared_ptr<Client>> m_clientsBySocket{};
+    std::vector<struct iovec> m_iovecs{};
+
+    std::atomic<bool> m_running{false};
+    std::thread m_thread{};
+};
+
+#endif
@@ -0,0 +1,59 @@
+/*
+ * Copyright (C) 2021  Christian Berger
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CHECK_HPP
+#define CHECK_HPP
+
+#include "cluon-complete.hpp"
+
+#include <cstdint>
+#include <iostream>
+#include <string>
+
+/**
+ * Minimal checks for the tests of the wire formats: every failed check is
+ * reported, and the test returns the number of failed checks.
+ */
+static uint32_t failedChecks{0};
+
+#define CHECK(condition)                                                                     \
+    do {                                                                                     \
+        if (!(condition)) {                                                                  \
+            std::cerr << __FILE__ << ":" << __LINE__ << ": failed: " #condition << std::endl; \
+            failedChecks++;                                                                  \
+        }                                                                                    \
+    } while (false)
+
+/**
+ * @return Serialized Envelope with the given fields and a payload of the given size.
+ */
+inline std::string envelope(int32_t dataType, uint32_t senderStamp, int64_t sampleTimeStamp, std::size_t size) {
+    cluon::data::Envelope env;
+    env.dataType(dataType);
+    env.senderStamp(senderStamp);
+    env.sent(cluon::time::fromMicroseconds(sampleTimeStamp + 10));
+    env.received(cluon::time::fromMicroseconds(sampleTimeStamp + 20));
+    env.sampleTimeStamp(cluon::time::fromMicroseconds(sampleTimeStamp));
+    std::string payload(size, '\0');
+    for (std::size_t i{0}; i < size; i++) {
+        payload[i] = static_cast<char>((i * 7 + static_cast<std::size_t>(sampleTimeStamp)) & 0xff);
+    }
+    env.serializedData(payload);
+    return cluon::serializeEnvelope(std::move(env));
+}
+
+#endif
@@ -0,0 +1,145 @@
+/*
+ * Copyright (C) 2021  Christian Berger
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "check.hpp"
+#include "compact-batch.hpp"
+#include "od4-frame.hpp"
+
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+/**
+ * @return The Envelopes in the given concatenated frames.
+ */
+static std::vector<cluon::data::Envelope> envelopesOf(const std::string &frames) {
+    std::vector<cluon::data::Envelope> envelopes;
+    std::stringstream sstr{frames};
+    while (sstr.good()) {
+        auto retVal = cluon::extractEnvelope(sstr);
+        if (!retVal.first) {
+            break;
+        }
+        envelopes.emplace_back(retVal.second);
+    }
+    return envelopes;
+}
+
+static bool isEqual(cluon::data::Envelope a, cluon::data::Envelope b) {
+    return (a.dataType() == b.dataType()) && (a.senderStamp() == b.senderStamp())
+           && (cluon::time::toMicroseconds(a.sent()) == cluon::time::toMicroseconds(b.sent()))
+           && (cluon::time::toMicroseconds(a.received()) == cluon::time::toMicroseconds(b.received()))
+           && (cluon::time::toMicroseconds(a.sampleTimeStamp()) == cluon::time::toMicroseconds(b.sampleTimeStamp()))
+           && (a.serializedData() == b.serializedData());
+}
+
+static void testRoundTrip() {
+    std::vector<od4::SharedFrame> frames;
+    std::string concatenated;
+    for (int64_t i{0}; i < 30; i++) {
+        std::string e{envelope(static_cast<int32_t>(19 + i % 3), static_cast<uint32_t>(i % 2), 1000000 - 500 * i, static_cast<std::size_t>(i))};
+        if (0 == i % 5) {
+            e = od4::withHopCount(std::move(e), 1);
+        }
+        frames.emplace_back(std::make_shared<const std::string>(e));
+        concatenated.append(e);
+    }
+    compact::pack(frames);
+    CHECK(1 == frames.size());
+    CHECK(frames[0]->size() < concatenated.size());
+
+    std::string out;
+    CHECK(compact::unpack(frames[0]->data(), frames[0]->size(), out));
+    const auto EXPECTED{envelopesOf(concatenated)};
+    const auto RESTORED{envelopesOf(out)};
+    CHECK(30 == EXPECTED.size());
+    CHECK(EXPECTED.size() == RESTORED.size());
+    for (std::size_t i{0}; (i < EXPECTED.size()) && (i < RESTORED.size()); i++) {
+        CHECK(isEqual(EXPECTED[i], RESTORED[i]));
+    }
+
+    // Every truncated batch is rejected.
+    for (std::size_t length{0}; length < frames[0]->size(); length++) {
+        CHECK(!compact::unpack(frames[0]->data(), length, out));
+    }
+}
+
+static void testExtensionFramesSplitRuns() {
+    const auto A{std::make_shared<const std::string>(envelope(19, 0, 1000000, 10))};
+    const auto B{std::make_shared<const std::string>(envelope(19, 0, 1000100, 10))};
+    const auto CHANNEL{std::make_shared<const std::string>(od4::channelFrame(2))};
+    std::vector<od4::SharedFrame> frames{A, B, CHANNEL, A};
+    compact::pack(frames);
+    CHECK(3 == frames.size());
+    CHECK(od4::ExtensionType::COMPACT_BATCH == od4::extensionType(frames[0]->data()));
+    CHECK(CHANNEL == frames[1]);
+    CHECK(A == frames[2]);
+}
+
+static void testOversizedCounts() {
+    std::string out;
+    // More streams than the batch can hold.
+    std::string streams{od4::beginExtension(od4::ExtensionType::COMPACT_BATCH)};
+    od4::writeVarInt(streams, 0);
+    od4::writeVarInt(streams, ~uint64_t{0});
+    streams.append("\x01\x01\x01\x01", 4);
+    CHECK(od4::finishExtension(streams));
+    CHECK(!compact::unpack(streams.data(), streams.size(), out));
+
+    // More Envelopes than the batch can hold.
+    std::string count{od4::beginExtension(od4::ExtensionType::COMPACT_BATCH)};
+    od4::writeVarInt(count, 0);
+    od4::writeVarInt(count, 1);
+    od4::writeVarInt(count, 19);
+    od4::writeVarInt(count, 0);
+    od4::writeVarInt(count, ~uint64_t{0});
+    count.append("\x00\x00\x00", 3);
+    CHECK(od4::finishExtension(count));
+    CHECK(!compact::unpack(count.data(), count.size(), out));
+
+    // A rest reaching beyond the batch.
+    std::string rest{od4::beginExtension(od4::ExtensionType::COMPACT_BATCH)};
+    od4::writeVarInt(rest, 0);
+    od4::writeVarInt(rest, 1);
+    od4::writeVarInt(rest, 19);
+    od4::writeVarInt(rest, 0);
+    od4::writeVarInt(rest, 1);
+    rest.append("\x00\x00", 2);
+    od4::writeVarInt(rest, 1000);
+    rest.append("abc");
+    CHECK(od4::finishExtension(rest));
+    CHECK(!compact::unpack(rest.data(), rest.size(), out));
+
+    // A stream index beyond the streams.
+    std::string stream{od4::beginExtension(od4::ExtensionType::COMPACT_BATCH)};
+    od4::writeVarInt(stream, 0);
+    od4::writeVarInt(stream, 1);
+    od4::writeVarInt(stream, 19);
+    od4::writeVarInt(stream, 0);
+    od4::writeVarInt(stream, 1);
+    stream.append("\x01\x00\x00", 3);
+    CHECK(od4::finishExtension(stream));
+    CHECK(!compact::unpack(stream.data(), stream.size(), out));
+}
+
+int32_t main(int32_t /*argc*/, char ** /*argv*/) {
+    testRoundTrip();
+    testExtensionFramesSplitRuns();
+    testOversizedCounts();
+    return static_cast<int32_t>(failedChecks);
+}
@@ -0,0 +1,131 @@
+/*
+ * Copyright (C) 2021  Christian Berger
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "check.hpp"
+#include "batch-compressor.hpp"
+#include "lz4-block.hpp"
+#include "od4-frame.hpp"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+static void roundTrip(const std::string &data) {
+    std::string block{"prefix"};
+    const std::size_t SIZE{lz4::compress(data.data(), data.size(), block)};
+    CHECK(block.size() == SIZE + 6);
+    std::string out(data.size(), '\0');
+    CHECK(lz4::decompress(block.data() + 6, SIZE, &out[0], out.size()));
+    CHECK(data == out);
+
+    // A block must decompress to exactly the given length.
+    std::string larger(data.size() + 1, '\0');
+    CHECK(!lz4::decompress(block.data() + 6, SIZE, &larger[0], larger.size()));
+    if (!data.empty()) {
+        CHECK(!lz4::decompress(block.data() + 6, SIZE, &out[0], out.size() - 1));
+    }
+
+    // Every truncated block is rejected; an empty block stands for empty data.
+    for (std::size_t size{data.empty() ? SIZE : 0}; size < SIZE; size++) {
+        CHECK(!lz4::decompress(block.data() + 6, size, &out[0], out.size()));
+    }
+}
+
+static void testBlocks() {
+    roundTrip("");
+    roundTrip("a");
+    roundTrip("abcdefghijkl");
+    roundTrip(std::string(13, 'x'));
+    roundTrip(std::string(100000, 'x'));
+
+    std::string text;
+    for (uint32_t i{0}; i < 5000; i++) {
+        text.append("frame " + std::to_string(i % 97) + ";");
+    }
+    roundTrip(text);
+
+    // Pseudo-random data does not compress and grows by the literal lengths only.
+    std::string noise(70000, '\0');
+    uint32_t state{1};
+    for (auto &c : noise) {
+        state = state * 1103515245U + 12345U;
+        c = static_cast<char>(state >> 24);
+    }
+    roundTrip(noise);
+    std::string block;
+    CHECK(lz4::compress(noise.data(), noise.size(), block) <= noise.size() + noise.size() / 255 + 16);
+}
+
+static void testMalformedBlocks() {
+    char out[16];
+    // A match before the first byte.
+    const std::string BEFORE_START{"\x14" "a" "\x02\x00", 4};
+    CHECK(!lz4::decompress(BEFORE_START.data(), BEFORE_START.size(), out, 6));
+    // A match with offset zero.
+    const std::string ZERO_OFFSET{"\x14" "a" "\x00\x00", 4};
+    CHECK(!lz4::decompress(ZERO_OFFSET.data(), ZERO_OFFSET.size(), out, 6));
+    // A literal length reaching beyond the block.
+    const std::string LONG_LITERALS{"\xf0\xff\xff\x10" "abc", 7};
+    CHECK(!lz4::decompress(LONG_LITERALS.data(), LONG_LITERALS.size(), out, sizeof(out)));
+    // A match reaching beyond the output.
+    const std::string LONG_MATCH{"\x1f" "a" "\x01\x00\x20", 5};
+    CHECK(!lz4::decompress(LONG_MATCH.data(), LONG_MATCH.size(), out, sizeof(out)));
+    // An overlapping match repeats the last byte.
+    const std::string OVERLAP{"\x12" "a" "\x01\x00", 4};
+    CHECK(lz4::decompress(OVERLAP.data(), OVERLAP.size(), out, 7));
+    CHECK(std::string(out, 7) == "aaaaaaa");
+}
+
+static void testBatchCompressor() {
+    std::vector<od4::SharedFrame> frames;
+    std::string concatenated;
+    for (int64_t i{0}; i < 20; i++) {
+        frames.emplace_back(std::make_shared<const std::string>(envelope(19, 0, 1000000 + i, 100)));
+        concatenated.append(*frames.back());
+    }
+
+    BatchCompressor compressor{1000.0};
+    compressor.process(frames);
+    CHECK(1 == frames.size());
+    CHECK(frames[0]->size() < concatenated.size());
+    std::string out;
+    CHECK(BatchCompressor::decompress(frames[0]->data(), frames[0]->size(), out));
+    CHECK(concatenated == out);
+    for (std::size_t length{0}; length < frames[0]->size(); length++) {
+        CHECK(!BatchCompressor::decompress(frames[0]->data(), length, out));
+    }
+
+    // An announced size beyond the limit is rejected before allocating it.
+    std::string oversized{od4::beginExtension(od4::ExtensionType::COMPRESSED_BATCH)};
+    od4::writeVarInt(oversized, uint64_t{1} << 40);
+    oversized.append("\x00", 1);
+    CHECK(od4::finishExtension(oversized));
+    CHECK(!BatchCompressor::decompress(oversized.data(), oversized.size(), out));
+
+    // Small batches stay as they are.
+    std::vector<od4::SharedFrame> small{std::make_shared<const std::string>(envelope(19, 0, 1, 10))};
+    compressor.process(small);
+    CHECK(1 == small.size());
+    CHECK(!od4::isExtension(small[0]->data(), small[0]->size()));
+}
+
+int32_t main(int32_t /*argc*/, char ** /*argv*/) {
+    testBlocks();
+    testMalformedBlocks();
+    testBatchCompressor();
+    return static_cast<int32_t>(failedChecks);
+}
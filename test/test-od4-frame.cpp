@@ -0,0 +1,112 @@
+/*
+ * Copyright (C) 2021  Christian Berger
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "check.hpp"
+#include "od4-frame.hpp"
+
+#include <string>
+#include <vector>
+
+static void testPeek() {
+    const std::string FRAME{od4::withHopCount(envelope(19, 3, 1000000, 100), 2)};
+    od4::EnvelopeInfo info;
+    CHECK(od4::peek(FRAME.data(), FRAME.size(), info));
+    CHECK(19 == info.dataType);
+    CHECK(3 == info.senderStamp);
+    CHECK(2 == info.hops);
+    CHECK(2 == od4::hopCount(FRAME));
+
+    // Every truncated Envelope is rejected.
+    for (std::size_t length{0}; length < FRAME.size(); length++) {
+        CHECK(!od4::peek(FRAME.data(), length, info));
+    }
+
+    // A field reaching beyond the Envelope is rejected, also if its length would wrap around.
+    for (uint64_t fieldLength : {uint64_t{3}, uint64_t{1000}, ~uint64_t{0} - 10}) {
+        std::string frame{"\x0D\xA4\x00\x00\x00\x0A", 6};
+        od4::writeVarInt(frame, fieldLength);
+        frame.append("ab");
+        od4::setPayloadLength(frame, static_cast<uint32_t>(frame.size() - od4::HEADER_SIZE));
+        CHECK(!od4::peek(frame.data(), frame.size(), info));
+    }
+
+    // The length in the header must not exceed the given bytes.
+    std::string oversized{FRAME};
+    od4::setPayloadLength(oversized, static_cast<uint32_t>(FRAME.size()));
+    CHECK(!od4::peek(oversized.data(), oversized.size(), info));
+}
+
+static void testChannelFrame() {
+    for (uint32_t channel : {0u, 1u, 300u, 0xffffffffu}) {
+        const std::string FRAME{od4::channelFrame(channel)};
+        uint32_t c{0};
+        CHECK(od4::channelOf(FRAME.data(), FRAME.size(), c));
+        CHECK(channel == c);
+        CHECK(!od4::channelOf(FRAME.data(), od4::EXTENSION_HEADER_SIZE, c));
+    }
+    std::string tooLarge{od4::beginExtension(od4::ExtensionType::CHANNEL)};
+    od4::writeVarInt(tooLarge, uint64_t{1} << 32);
+    od4::finishExtension(tooLarge);
+    uint32_t c{0};
+    CHECK(!od4::channelOf(tooLarge.data(), tooLarge.size(), c));
+}
+
+static void testFrameDecoder() {
+    const std::vector<std::string> FRAMES{envelope(19, 0, 1000000, 10), od4::channelFrame(1), envelope(31, 2, 2000000, 300), envelope(12, 1, 3000000, 0)};
+    std::string stream{"garbage\x0D"};
+    for (const auto &f : FRAMES) {
+        stream.append(f);
+    }
+    stream.append("\x0D\xA4", 2); // Start of an incomplete frame.
+
+    auto decodeInChunks = [&stream](const std::vector<std::size_t> &splits, std::vector<std::string> &frames) {
+        od4::FrameDecoder decoder;
+        std::size_t skipped{0};
+        std::size_t begin{0};
+        for (std::size_t end : splits) {
+            skipped += decoder.decode(stream.data() + begin, end - begin, [&frames](const char *frame, std::size_t length) {
+                frames.emplace_back(frame, length);
+            });
+            begin = end;
+        }
+        CHECK(2 == decoder.pending());
+        return skipped;
+    };
+
+    // Split the stream into two chunks at every byte position.
+    for (std::size_t split{0}; split <= stream.size(); split++) {
+        std::vector<std::string> frames;
+        CHECK(8 == decodeInChunks({split, stream.size()}, frames));
+        CHECK(FRAMES == frames);
+    }
+
+    // Feed the stream byte by byte.
+    std::vector<std::size_t> splits;
+    for (std::size_t i{1}; i <= stream.size(); i++) {
+        splits.push_back(i);
+    }
+    std::vector<std::string> frames;
+    CHECK(8 == decodeInChunks(splits, frames));
+    CHECK(FRAMES == frames);
+}
+
+int32_t main(int32_t /*argc*/, char ** /*argv*/) {
+    testPeek();
+    testChannelFrame();
+    testFrameDecoder();
+    return static_cast<int32_t>(failedChecks);
+}
@@ -0,0 +1,129 @@
+/*
+ * Copyright (C) 2021  Christian Berger
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "check.hpp"
+#include "od4-frame.hpp"
+#include "stream-delta.hpp"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+static void testRoundTrip() {
+    delta::DeltaEncoder encoder{4};
+    delta::DeltaDecoder decoder;
+    for (int64_t i{0}; i < 20; i++) {
+        // The same streams on two channels are encoded separately.
+        std::vector<od4::SharedFrame> originals{std::make_shared<const std::string>(envelope(19, 0, 1000000 + 10 * i, 200)),
+                                                std::make_shared<const std::string>(envelope(31, 1, 1000000 + 20 * i, static_cast<std::size_t>(i))),
+                                                std::make_shared<const std::string>(od4::channelFrame(7)),
+                                                std::make_shared<const std::string>(envelope(19, 0, 5000000 - 10 * i, 200))};
+        std::vector<od4::SharedFrame> frames{originals};
+        encoder.process(frames);
+        CHECK(originals.size() == frames.size());
+        CHECK(originals[2] == frames[2]);
+
+        uint32_t channel{0};
+        for (std::size_t j{0}; j < frames.size(); j++) {
+            if (od4::channelOf(frames[j]->data(), frames[j]->size(), channel)) {
+                continue;
+            }
+            std::string out;
+            CHECK(decoder.decode(channel, frames[j]->data(), frames[j]->size(), out));
+            CHECK(*originals[j] == out);
+        }
+    }
+}
+
+static void testMissedFrames() {
+    delta::DeltaEncoder encoder{4};
+    delta::DeltaDecoder decoder;
+    std::vector<od4::SharedFrame> frames;
+    for (int64_t i{0}; i < 9; i++) {
+        // The payloads repeat every 256 microseconds.
+        frames.emplace_back(std::make_shared<const std::string>(envelope(19, 0, 1000000 + 256 * i, 100)));
+    }
+    const std::vector<od4::SharedFrame> ORIGINALS{frames};
+    encoder.process(frames);
+    // Envelopes that differ in their time stamps only are encoded in a few bytes.
+    CHECK(frames[1]->size() + 80 < ORIGINALS[1]->size());
+
+    // Frames 0, 4, and 8 are keyframes; after frame 1 is lost, the deltas are dropped until frame 4.
+    std::string out;
+    CHECK(decoder.decode(0, frames[0]->data(), frames[0]->size(), out));
+    for (std::size_t i{2}; i < 4; i++) {
+        CHECK(!decoder.decode(0, frames[i]->data(), frames[i]->size(), out));
+    }
+    for (std::size_t i{4}; i < 9; i++) {
+        CHECK(decoder.decode(0, frames[i]->data(), frames[i]->size(), out));
+        CHECK(*ORIGINALS[i] == out);
+    }
+
+    // A delta cannot be decoded on another channel.
+    delta::DeltaDecoder other;
+    CHECK(other.decode(0, frames[4]->data(), frames[4]->size(), out));
+    CHECK(!other.decode(1, frames[5]->data(), frames[5]->size(), out));
+}
+
+static void testMalformedFrames() {
+    delta::DeltaEncoder encoder{1};
+    std::vector<od4::SharedFrame> frames{std::make_shared<const std::string>(envelope(19, 0, 1000000, 100))};
+    encoder.process(frames);
+    std::string out;
+
+    // Every truncated keyframe is rejected.
+    for (std::size_t length{0}; length < frames[0]->size(); length++) {
+        delta::DeltaDecoder decoder;
+        CHECK(!decoder.decode(0, frames[0]->data(), length, out));
+    }
+
+    auto frameWith = [](uint64_t kind, uint64_t size, const std::vector<uint64_t> &ops) {
+        std::string frame{od4::beginExtension(od4::ExtensionType::DELTA)};
+        od4::writeVarInt(frame, 19);
+        od4::writeVarInt(frame, 0);
+        od4::writeVarInt(frame, 1);
+        frame.push_back(static_cast<char>(kind));
+        od4::writeVarInt(frame, size);
+        for (uint64_t op : ops) {
+            od4::writeVarInt(frame, op);
+        }
+        frame.append("abcd");
+        od4::finishExtension(frame);
+        return frame;
+    };
+    delta::DeltaDecoder decoder;
+    const std::string VALID{frameWith(0, 4, {0, 4})};
+    CHECK(decoder.decode(0, VALID.data(), VALID.size(), out));
+    CHECK("abcd" == out);
+    for (const std::string &frame : {frameWith(0, delta::MAX_FRAME_SIZE + 1, {0, 4}), // Oversized Envelope.
+                                     frameWith(0, 4, {0, 5}),                          // Literals beyond the Envelope.
+                                     frameWith(0, 8, {0, 8}),                          // Literals beyond the frame.
+                                     frameWith(0, 4, {2, 2}),                          // Copy from a keyframe.
+                                     frameWith(0, 4, {0, 0}),                          // Empty operation.
+                                     frameWith(0, 4, {~uint64_t{0}, 4}),               // Copy that would wrap around.
+                                     frameWith(2, 4, {0, 4})}) {                       // Unknown kind.
+        delta::DeltaDecoder d;
+        CHECK(!d.decode(0, frame.data(), frame.size(), out));
+    }
+}
+
+int32_t main(int32_t /*argc*/, char ** /*argv*/) {
+    testRoundTrip();
+    testMissedFrames();
+    testMalformedFrames();
+    return static_cast<int32_t>(failedChecks);
+}